@@ -0,0 +1,235 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Offline analysis of result logs written by timer --log=FILE.
+ *
+ * The log is mapped read-only and reductions run directly over the column
+ * arrays in the mapping. "analyze compare BASE NEW" compares two logs, e.g.
+ * from two host kernels, and flags significant regressions.
+ */
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <map>
+#include <vector>
+
+#include "host_info.hpp"
+#include "options.hpp"
+#include "result_log.hpp"
+#include "stats.hpp"
+
+struct column_summary {
+  int64_t min = std::numeric_limits<int64_t>::max();
+  int64_t max = std::numeric_limits<int64_t>::min();
+  double sum = 0;
+};
+
+/* Min, max and sum of one column across all blocks, read straight from the mapping. */
+static column_summary summarize(result_log_reader const &log, log_column c)
+{
+  column_summary s;
+
+  for (uint64_t b = 0; b < log.blocks(); b++) {
+    int64_t const *values = log.column(b, c);
+    uint64_t rows = log.rows(b);
+    int64_t min = s.min, max = s.max;
+    double sum = 0;
+
+    for (uint64_t i = 0; i < rows; i++) {
+      min = std::min(min, values[i]);
+      max = std::max(max, values[i]);
+      sum += double(values[i]);
+    }
+
+    s.min = min;
+    s.max = max;
+    s.sum += sum;
+  }
+
+  return s;
+}
+
+struct timeout_samples {
+  std::vector<double> reps_per_ms;
+  std::vector<double> overshoot_us;
+};
+
+/*
+ * Quantiles need the derived per-slice values sorted, which the read-only
+ * mapping can't provide in place, so this is the one reduction that copies.
+ */
+static std::map<int64_t, timeout_samples> group_by_timeout(result_log_reader const &log)
+{
+  std::map<int64_t, timeout_samples> groups;
+
+  for (uint64_t b = 0; b < log.blocks(); b++) {
+    int64_t const *timeout = log.column(b, col_timeout_ns);
+    int64_t const *reps = log.column(b, col_reps);
+    int64_t const *wall = log.column(b, col_wall_ns);
+    int64_t const *overshoot = log.column(b, col_overshoot_ns);
+
+    for (uint64_t i = 0; i < log.rows(b); i++) {
+      auto &group = groups[timeout[i]];
+
+      group.reps_per_ms.push_back(wall[i] > 0 ? reps[i] * 1e6 / wall[i] : 0);
+      group.overshoot_us.push_back(overshoot[i] / 1e3);
+    }
+  }
+
+  return groups;
+}
+
+/* Fit reps against the timeout. Reps that stop scaling linearly show up as a poor fit. */
+static linear_fit fit_reps(result_log_reader const &log)
+{
+  std::vector<double> x, y;
+
+  x.reserve(log.total_rows());
+  y.reserve(log.total_rows());
+
+  for (uint64_t b = 0; b < log.blocks(); b++) {
+    int64_t const *timeout = log.column(b, col_timeout_ns);
+    int64_t const *reps = log.column(b, col_reps);
+
+    for (uint64_t i = 0; i < log.rows(b); i++) {
+      x.push_back(timeout[i] / 1e6);
+      y.push_back(double(reps[i]));
+    }
+  }
+
+  return fit_linear(x.data(), y.data(), x.size());
+}
+
+static int summary(char const *path)
+{
+  result_log_reader log { path };
+  uint64_t rows = log.total_rows();
+
+  printf("%" PRIu64 " slices in %" PRIu64 " blocks\n\n", rows, log.blocks());
+
+  for (auto const &v : host_fingerprint::parse(log.metadata()))
+    printf("host %s=%s\n", v.first.c_str(), v.second.c_str());
+  printf("\n");
+
+  if (rows == 0)
+    return 0;
+
+  printf("%-14s %16s %16s %16s\n", "column", "min", "mean", "max");
+  for (unsigned c = 0; c < log_columns; c++) {
+    column_summary s = summarize(log, log_column(c));
+    printf("%-14s %16" PRId64 " %16.1f %16" PRId64 "\n", log_column_names[c], s.min, s.sum / rows, s.max);
+  }
+
+  printf("\n%10s %8s %12s %12s %12s %14s %14s\n", "timeout_ms", "slices", "reps/ms p1", "reps/ms p50",
+         "reps/ms p99", "overshoot p50", "overshoot p99");
+  for (auto &group : group_by_timeout(log)) {
+    auto &s = group.second;
+
+    printf("%10.3f %8zu %12.1f %12.1f %12.1f %12.1fus %12.1fus\n", group.first / 1e6, s.reps_per_ms.size(),
+           quantile(s.reps_per_ms, 0.01), quantile(s.reps_per_ms, 0.5), quantile(s.reps_per_ms, 0.99),
+           quantile(s.overshoot_us, 0.5), quantile(s.overshoot_us, 0.99));
+  }
+
+  linear_fit fit = fit_reps(log);
+  printf("\nreps = %.1f * timeout_ms %+.1f (r^2 %.4f)\n", fit.slope, fit.intercept, fit.r2);
+
+  return 0;
+}
+
+/*
+ * Compare one metric between two sample sets. Returns true if the new samples
+ * are significantly worse. For reps/ms lower is worse, for overshoot higher.
+ */
+static bool compare_metric(char const *name, std::vector<double> &base, std::vector<double> &cur,
+                           bool higher_is_better, double alpha, double confidence)
+{
+  rank_test test = mann_whitney(base, cur);
+  shift_estimate shift = hodges_lehmann(base, cur, confidence);
+  double base_median = quantile(base, 0.5);
+  double scale = base_median != 0 ? 100.0 / std::fabs(base_median) : NAN;
+
+  bool worse = higher_is_better ? shift.hi < 0 : shift.lo > 0;
+  bool regression = test.p < alpha and worse;
+
+  printf("  %-10s %12.1f %12.1f %+8.2f%% [%+8.2f%%, %+8.2f%%] p=%-10.2g %s\n", name, base_median,
+         quantile(cur, 0.5), shift.shift * scale, shift.lo * scale, shift.hi * scale, test.p,
+         regression ? "REGRESSION" : "");
+
+  return regression;
+}
+
+/*
+ * Per-timeout comparison of reps/ms and overshoot. Deltas are Hodges-Lehmann
+ * shift estimates relative to the base median, p-values come from the
+ * Mann-Whitney U test. To keep false alarms in check across all timeouts, the
+ * significance level is Bonferroni-corrected.
+ */
+static int compare(char const *base_path, char const *cur_path, options const &opts)
+{
+  result_log_reader base_log { base_path };
+  result_log_reader cur_log { cur_path };
+  auto base = group_by_timeout(base_log);
+  auto cur = group_by_timeout(cur_log);
+
+  double confidence = opts.get_double("confidence", 0.95);
+  size_t tests = 0;
+
+  // Differences in the host setup are the most common source of false alarms.
+  auto base_host = host_fingerprint::parse(base_log.metadata());
+  auto cur_host = host_fingerprint::parse(cur_log.metadata());
+
+  for (auto const &v : base_host) {
+    auto other = cur_host.find(v.first);
+    if (other != cur_host.end() and other->second != v.second)
+      printf("warning: host %s differs: %s vs %s\n", v.first.c_str(), v.second.c_str(), other->second.c_str());
+  }
+
+  for (auto const &group : base)
+    if (cur.count(group.first))
+      tests += 2;
+
+  if (tests == 0) {
+    fprintf(stderr, "no common timeouts\n");
+    return EXIT_FAILURE;
+  }
+
+  double alpha = (1 - confidence) / tests;
+  unsigned regressions = 0;
+
+  printf("  %-10s %12s %12s %9s %22s\n", "metric", "base p50", "new p50", "delta", "confidence interval");
+
+  for (auto &group : base) {
+    auto other = cur.find(group.first);
+    if (other == cur.end())
+      continue;
+
+    printf("timeout %.3fms (%zu vs %zu slices)\n", group.first / 1e6, group.second.reps_per_ms.size(),
+           other->second.reps_per_ms.size());
+
+    regressions += compare_metric("reps/ms", group.second.reps_per_ms, other->second.reps_per_ms, true, alpha,
+                                  confidence);
+    regressions += compare_metric("overshoot", group.second.overshoot_us, other->second.overshoot_us, false, alpha,
+                                  confidence);
+  }
+
+  printf("\n%u significant regressions (alpha %.2g per test)\n", regressions, alpha);
+  return regressions ? 2 : 0;
+}
+
+int main(int argc, char **argv)
+{
+  options opts { argc, argv, false };
+  auto const &args = opts.args();
+
+  if (args.size() == 1)
+    return summary(args[0].c_str());
+
+  if (args.size() == 3 and args[0] == "compare")
+    return compare(args[1].c_str(), args[2].c_str(), opts);
+
+  fprintf(stderr, "usage: %s LOG\n"
+                  "       %s compare [--confidence=C] BASE NEW\n", argv[0], argv[0]);
+  return EXIT_FAILURE;
+}
@@ -7,12 +7,927 @@
 BITS 64
 ORG 0
 
+        ; Workloads only use RIP-relative addressing for their own data, so
+        ; they can also run natively on the host (see native.hpp).
+DEFAULT REL
+
+        ; The host looks up workload entry points in this table. The order
+        ; must match enum guest_entry in timer.cpp.
+entry_table:
+        dq slack_off
+        dq slack_off_timeline
+        dq vector_loop
+        dq alu_loop
+        dq ticket_lock_loop
+        dq tas_lock_loop
+        dq pv_lock_loop
+        dq ipi_sender
+        dq ipi_receiver
+        dq tlb_shootdown
+        dq tlb_receiver
+        dq page_fault_loop
+        dq cr3_switch_loop
+        dq msr_loop
+        dq tsc_loop
+        dq kvmclock_loop
+        dq steal_loop
+
+        ; Interrupt handlers that the host installs in the IDT. The order
+        ; must match enum guest_handler in timer.cpp.
+handler_table:
+        dq ipi_handler
+        dq tlb_handler
+        dq page_fault_handler
+        dq alignment_check_handler
+        dq debug_handler
+
+        ; The host points all other exception vectors at exception_stubs.
+        dq exception_stubs
+
+IPI_VECTOR      equ 0x40
+IPI_CAPACITY    equ 65536           ; ipi_capacity in timer.cpp
+TLB_VECTOR      equ 0x41
+TLB_CAPACITY    equ 65536           ; tlb_shared::capacity in timer.cpp
+
+EXCEPTION_PORT  equ 0xe0            ; guest_exception_port in timer.cpp
+SHARED_BASE     equ 0x100000        ; guest_vm::shared_base in timer.cpp
+NOTIFY_PORT     equ 0xe1            ; guest_notify_port in timer.cpp
+
+KVM_VCPU_PREEMPTED equ 1
+KVM_VCPU_FLUSH_TLB equ 2
+
+MSR_TEST_CTRL   equ 0x33
+SPLIT_LOCK_DETECT equ 1 << 29
+RFLAGS_TF       equ 0x100
+
+X2APIC_ID       equ 0x802
+X2APIC_EOI      equ 0x80b
+X2APIC_SVR      equ 0x80f
+X2APIC_ICR      equ 0x830
+
 slack_off:
         mov rdi, 0x16c
         lock bts qword [scratchspace + 0x54], rdi
         inc rax
 	jmp slack_off
 
+        ; Same as slack_off, but append a (TSC, iteration count) sample to
+        ; the timeline ring every rbx iterations. The iteration count is
+        ; kept in r15, because rdtsc clobbers rax.
+        ;
+        ; rsi: timeline ring (struct timeline_ring in timeline.hpp)
+        ; rbx: sample interval in iterations
+        ; rcx: ring capacity - 1
+slack_off_timeline:
+        xor r15, r15
+        jmp .sample
+.loop:
+        mov rdi, 0x16c
+        lock bts qword [scratchspace + 0x54], rdi
+        inc r15
+        dec r8
+        jnz .loop
+
+.sample:
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        mov rdx, [rsi]
+        mov r9, rdx
+        and r9, rcx
+        shl r9, 4
+        mov [rsi + 16 + r9], rax
+        mov [rsi + 24 + r9], r15
+        inc rdx
+        mov [rsi], rdx
+        mov r8, rbx
+        jmp .loop
+
+        ; A dependency chain of SSE2 integer additions that never touches
+        ; memory.
+vector_loop:
+        pcmpeqd xmm1, xmm1
+.loop:
+        paddq xmm0, xmm1
+        paddq xmm0, xmm1
+        paddq xmm0, xmm1
+        paddq xmm0, xmm1
+        inc rax
+        jmp .loop
+
+        ; A single-cycle dependency chain. Its throughput only depends on
+        ; the core clock and on how much of the time the vCPU actually
+        ; runs.
+alu_loop:
+        inc rax
+        jmp alu_loop
+
+        ; Spinlock workloads for several vCPUs. Each iteration acquires the
+        ; lock, spins rbx times inside the critical section and releases
+        ; it. While it holds the lock, a vCPU stores its owner id in the
+        ; lock, so the host knows whom to preempt.
+        ;
+        ; rsi: lock (struct guest_spinlock in timer.cpp)
+        ; rdi: owner id, must not be zero
+        ; rbx: length of the critical section, must not be zero
+        ; rax: acquisitions
+        ; r14: PAUSE iterations spent waiting for the lock
+
+        ; A fair ticket lock
+ticket_lock_loop:
+        mov rdx, 1
+        lock xadd [rsi], rdx
+.spin:
+        cmp [rsi + 8], rdx
+        je .locked
+        pause
+        inc r14
+        jmp .spin
+.locked:
+        mov [rsi + 64], rdi
+        mov rcx, rbx
+.critical:
+        dec rcx
+        jnz .critical
+        mov qword [rsi + 64], 0
+        inc qword [rsi + 8]
+        inc rax
+        jmp ticket_lock_loop
+
+        ; Test-and-set with PAUSE while the lock is taken
+tas_lock_loop:
+        mov rdx, 1
+        xchg [rsi + 16], rdx
+        test rdx, rdx
+        jz .locked
+.spin:
+        pause
+        inc r14
+        cmp qword [rsi + 16], 0
+        jne .spin
+        jmp tas_lock_loop
+.locked:
+        mov [rsi + 64], rdi
+        mov rcx, rbx
+.critical:
+        dec rcx
+        jnz .critical
+        mov qword [rsi + 64], 0
+        mov qword [rsi + 16], 0
+        inc rax
+        jmp tas_lock_loop
+
+        ; Ticket lock with paravirtual waiting. After r10 PAUSE iterations
+        ; without getting the lock, a waiter either halts until the
+        ; releasing vCPU kicks it with KVM_HC_KICK_CPU (r12 = 1) or yields
+        ; its CPU to the lock holder with KVM_HC_SCHED_YIELD (r12 = 2).
+        ; With r12 = 0, it just keeps spinning. vCPU n has APIC ID n.
+        ;
+        ; rsi: lock (struct guest_spinlock in timer.cpp)
+        ; rdi: owner id, must not be zero
+        ; r8:  length of the critical section, must not be zero
+        ; r9:  number of vCPUs
+        ; r10: PAUSE iterations before halting or yielding, must not be zero
+        ; r12: waiting strategy
+        ; r15: acquisitions
+        ; r14: PAUSE iterations spent waiting for the lock
+        ; r13: TSC cycles spent waiting for the lock
+        ; r11: halts or yields
+        ;
+        ; Hypercalls clobber rax, which is why the counters live elsewhere.
+pv_lock_loop:
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        mov rbp, rax
+        mov rdx, 1
+        lock xadd [rsi], rdx
+        mov rcx, r10
+.spin:
+        cmp [rsi + 8], rdx
+        je .locked
+        pause
+        inc r14
+        dec rcx
+        jnz .spin
+
+        mov rcx, r10
+        cmp r12, 1
+        je .halt
+        cmp r12, 2
+        jne .spin
+
+        ; Yield to the lock holder, if there is one.
+        mov rbx, [rsi + 64]
+        test rbx, rbx
+        jz .spin
+        dec rbx
+        mov rax, 11             ; KVM_HC_SCHED_YIELD
+        vmcall
+        inc r11
+        jmp .spin
+
+        ; Announce which ticket we wait for (plus one, zero means not
+        ; waiting) in our slot. The locked xchg orders this against
+        ; checking the lock again. If the releaser kicks us after the
+        ; check, KVM remembers the kick and hlt returns immediately.
+.halt:
+        lea rax, [rdx + 1]
+        xchg [rsi + 120 + rdi * 8], rax
+        cmp [rsi + 8], rdx
+        je .unwait
+        hlt
+        inc r11
+.unwait:
+        mov qword [rsi + 120 + rdi * 8], 0
+        jmp .spin
+
+.locked:
+        mov [rsi + 64], rdi
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        sub rax, rbp
+        add r13, rax
+        mov rcx, r8
+.critical:
+        dec rcx
+        jnz .critical
+        mov qword [rsi + 64], 0
+        mov rdx, [rsi + 8]
+        inc rdx
+        mov [rsi + 8], rdx
+        inc r15
+        cmp r12, 1
+        jne pv_lock_loop
+
+        ; Kick the vCPU that waits for the next ticket. The mfence pairs
+        ; with the xchg of the waiter.
+        inc rdx
+        mfence
+        xor rcx, rcx
+.find_waiter:
+        cmp [rsi + 128 + rcx * 8], rdx
+        je .kick
+        inc rcx
+        cmp rcx, r9
+        jne .find_waiter
+        jmp pv_lock_loop
+.kick:
+        mov rax, 5              ; KVM_HC_KICK_CPU
+        xor rbx, rbx            ; flags, rcx: APIC ID
+        vmcall
+        jmp pv_lock_loop
+
+        ; IPI benchmark. vCPU 0 sends IPIs to the other vCPUs and measures
+        ; how many TSC cycles pass until each receiver's interrupt handler
+        ; runs. All parameters are in struct ipi_shared in timer.cpp:
+        ;
+        ;   0:  samples written so far
+        ;   8:  number of vCPUs
+        ;   16: 0 = write the x2APIC ICR, 1 = KVM_HC_SEND_IPI
+        ;   24: 0 = one receiver at a time, 1 = all receivers at once
+        ;   32: TSC cycles to wait between rounds
+        ;   64: 64-byte slot per vCPU: delivery TSC, ready flag
+        ;   4160: ring of latency samples
+        ;
+        ; rsi: struct ipi_shared
+        ; r15: rounds
+ipi_sender:
+        mov r14, rsi
+        mov rdi, [r14 + 8]
+        mov ecx, X2APIC_SVR
+        mov eax, 0x1ff
+        xor edx, edx
+        wrmsr
+
+        ; Wait for all receivers to enable interrupts.
+        mov rcx, 1
+.wait_ready:
+        mov rax, rcx
+        shl rax, 6
+.not_ready:
+        pause
+        cmp qword [r14 + 72 + rax], 0
+        je .not_ready
+        inc rcx
+        cmp rcx, rdi
+        jne .wait_ready
+
+        mov r12, 1              ; next receiver for one-to-one IPIs
+.round:
+        mov rcx, r12
+        mov r8, r12
+        inc r8
+        cmp qword [r14 + 24], 0
+        je .clear
+        mov rcx, 1
+        mov r8, rdi
+.clear:
+        mov rax, rcx
+        shl rax, 6
+        mov qword [r14 + 64 + rax], 0
+        inc rcx
+        cmp rcx, r8
+        jne .clear
+
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        mov r13, rax
+        cmp qword [r14 + 16], 0
+        jne .hypercall
+
+        mov ecx, X2APIC_ICR
+        mov eax, IPI_VECTOR | 0x4000
+        mov edx, r12d
+        cmp qword [r14 + 24], 0
+        je .write_icr
+        or eax, 0xc0000         ; all excluding self
+        xor edx, edx
+.write_icr:
+        wrmsr
+        jmp .wait
+
+.hypercall:
+        mov rbx, 1
+        mov ecx, r12d
+        shl rbx, cl
+        cmp qword [r14 + 24], 0
+        je .send_hypercall
+        mov ecx, edi
+        mov rbx, 1
+        shl rbx, cl
+        sub rbx, 2              ; all vCPUs but 0
+.send_hypercall:
+        mov eax, 10             ; KVM_HC_SEND_IPI
+        xor ecx, ecx            ; upper half of the bitmap
+        xor edx, edx            ; lowest APIC ID
+        mov esi, IPI_VECTOR
+        vmcall
+
+        ; Collect a sample for every receiver of this round.
+.wait:
+        mov rcx, r12
+        cmp qword [r14 + 24], 0
+        je .wait_one
+        mov rcx, 1
+.wait_one:
+        mov rax, rcx
+        shl rax, 6
+.not_delivered:
+        mov rdx, [r14 + 64 + rax]
+        test rdx, rdx
+        jnz .delivered
+        pause
+        jmp .not_delivered
+.delivered:
+        sub rdx, r13
+        mov rbx, [r14]
+        mov r11, rbx
+        and r11, IPI_CAPACITY - 1
+        mov [r14 + 4160 + r11 * 8], rdx
+        inc rbx
+        mov [r14], rbx
+        inc rcx
+        cmp qword [r14 + 24], 0
+        je .next_receiver
+        cmp rcx, rdi
+        jne .wait_one
+
+.next_receiver:
+        inc r12
+        cmp r12, rdi
+        jne .delay
+        mov r12, 1
+
+.delay:
+        inc r15
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        mov rbx, rax
+        add rbx, [r14 + 32]
+.delay_loop:
+        pause
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        cmp rax, rbx
+        jb .delay_loop
+        jmp .round
+
+        ; The other vCPUs of the IPI benchmark take interrupts while they
+        ; spin (rdi = 0) or halt (rdi = 1). r15 counts loop iterations.
+        ;
+        ; rsi: struct ipi_shared
+        ; r13: this vCPU's slot, used by ipi_handler
+ipi_receiver:
+        mov ecx, X2APIC_SVR
+        mov eax, 0x1ff
+        xor edx, edx
+        wrmsr
+        sti
+        mov qword [r13 + 8], 1
+        test rdi, rdi
+        jnz .halt
+.spin:
+        pause
+        inc r15
+        jmp .spin
+.halt:
+        hlt
+        inc r15
+        jmp .halt
+
+ipi_handler:
+        push rax
+        push rcx
+        push rdx
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        mov [r13], rax
+        mov ecx, X2APIC_EOI
+        xor eax, eax
+        xor edx, edx
+        wrmsr
+        pop rdx
+        pop rcx
+        pop rax
+        iretq
+
+        ; TLB shootdown benchmark. vCPU 0 repeatedly remaps a page between
+        ; two frames and flushes it from the TLBs of all other vCPUs, which
+        ; keep reading from it. All parameters are in struct tlb_shared in
+        ; timer.cpp:
+        ;
+        ;   0:  shootdowns so far
+        ;   8:  number of vCPUs
+        ;   16: 1 = use PV TLB flush for preempted vCPUs
+        ;   24: TSC cycles to wait between shootdowns
+        ;   32: remote flushes left to KVM by PV TLB flush
+        ;   40: generation of the current shootdown
+        ;   48: address of the PTE that maps the page
+        ;   56: address of the page
+        ;   64: the two PTE values to alternate between
+        ;   128: 64-byte slot per vCPU: acknowledged generation, ready flag
+        ;   4224: struct kvm_steal_time per vCPU
+        ;   8320: ring of latency samples
+        ;
+        ; Without PV TLB flush, every other vCPU gets an IPI and invalidates
+        ; the page in its handler. With it, vCPUs whose steal time says they
+        ; are preempted are only marked, and KVM flushes their TLB before
+        ; they run again, just like Linux guests do.
+        ;
+        ; rsi: struct tlb_shared
+        ; r15: shootdowns
+tlb_shootdown:
+        mov r14, rsi
+        mov rdi, [r14 + 8]
+        mov ecx, X2APIC_SVR
+        mov eax, 0x1ff
+        xor edx, edx
+        wrmsr
+
+        mov rcx, 1
+.wait_ready:
+        mov rax, rcx
+        shl rax, 6
+.not_ready:
+        pause
+        cmp qword [r14 + 136 + rax], 0
+        je .not_ready
+        inc rcx
+        cmp rcx, rdi
+        jne .wait_ready
+
+.round:
+        mov rbx, [r14 + 40]
+        inc rbx
+        mov [r14 + 40], rbx
+
+        ; Remap the page to the other frame.
+        mov rax, rbx
+        and rax, 1
+        mov rax, [r14 + 64 + rax * 8]
+        mov rdx, [r14 + 48]
+        mov [rdx], rax
+        mov rax, [r14 + 56]
+        invlpg [rax]
+
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        mov r13, rax
+
+        mov r12, 1
+.flush_one:
+        mov r8, r12
+        shl r8, 6
+        cmp qword [r14 + 16], 0
+        je .send_ipi
+
+        ; A preempted vCPU is flushed by KVM on its next entry.
+        lea r9, [r14 + 4224 + r8 + 16]
+        movzx eax, byte [r9]
+        test eax, KVM_VCPU_PREEMPTED
+        jz .send_ipi
+        mov edx, eax
+        or edx, KVM_VCPU_FLUSH_TLB
+        lock cmpxchg [r9], dl
+        jne .send_ipi
+        mov [r14 + 128 + r8], rbx
+        inc qword [r14 + 32]
+        jmp .next_target
+
+.send_ipi:
+        mov ecx, X2APIC_ICR
+        mov eax, TLB_VECTOR | 0x4000
+        mov edx, r12d
+        wrmsr
+.next_target:
+        inc r12
+        cmp r12, rdi
+        jne .flush_one
+
+        ; Wait until every vCPU has acknowledged this generation.
+        mov r12, 1
+.wait_ack:
+        mov r8, r12
+        shl r8, 6
+.not_acked:
+        cmp [r14 + 128 + r8], rbx
+        je .acked
+        pause
+        jmp .not_acked
+.acked:
+        inc r12
+        cmp r12, rdi
+        jne .wait_ack
+
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        sub rax, r13
+        mov rcx, [r14]
+        mov rdx, rcx
+        and rdx, TLB_CAPACITY - 1
+        mov [r14 + 8320 + rdx * 8], rax
+        inc rcx
+        mov [r14], rcx
+        inc r15
+
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        mov rbx, rax
+        add rbx, [r14 + 24]
+.delay_loop:
+        pause
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        cmp rax, rbx
+        jb .delay_loop
+        jmp .round
+
+        ; The other vCPUs of the TLB shootdown benchmark keep the page in
+        ; their TLB by reading from it. r15 counts reads.
+        ;
+        ; rsi: struct tlb_shared
+        ; r13: this vCPU's slot, used by tlb_handler
+tlb_receiver:
+        mov r14, rsi
+        mov r12, [r14 + 56]
+        mov ecx, X2APIC_SVR
+        mov eax, 0x1ff
+        xor edx, edx
+        wrmsr
+        sti
+        mov qword [r13 + 8], 1
+.read:
+        mov rax, [r12]
+        inc r15
+        pause
+        jmp .read
+
+        ; r12: the page, r13: slot, r14: struct tlb_shared
+tlb_handler:
+        push rax
+        push rcx
+        push rdx
+        invlpg [r12]
+        mov rax, [r14 + 40]
+        mov [r13], rax
+        mov ecx, X2APIC_EOI
+        xor eax, eax
+        xor edx, edx
+        wrmsr
+        pop rdx
+        pop rcx
+        pop rax
+        iretq
+
+        ; Page fault benchmark. Writes to every page once per pass and
+        ; stops at NOTIFY_PORT after each pass, so the host can discard the
+        ; memory behind the pages. With r9 = 1, the pages are unmapped after
+        ; each pass and page_fault_handler maps them again on first access.
+        ;
+        ; rsi: first page, mapped 1:1
+        ; rdi: number of pages
+        ; r8:  GPA of the PTE of the first page, the others follow
+        ; r9:  1 = unmap the pages after every pass, the host also has to
+        ;      describe the pages in struct fault_shared for the handler
+        ; r15: accesses
+        ; r14: passes
+        ; r13: TSC cycles spent in accesses, including faults
+page_fault_loop:
+        xor ecx, ecx
+.touch:
+        mov rbx, rcx
+        shl rbx, 12
+        add rbx, rsi
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        mov r10, rax
+        mov [rbx], r15
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        sub rax, r10
+        add r13, rax
+        inc r15
+        inc rcx
+        cmp rcx, rdi
+        jne .touch
+
+        inc r14
+        test r9, r9
+        jz .pass_done
+
+        xor ecx, ecx
+.unmap:
+        mov qword [r8 + rcx * 8], 0
+        inc rcx
+        cmp rcx, rdi
+        jne .unmap
+        mov rax, cr3
+        mov cr3, rax
+
+.pass_done:
+        out NOTIFY_PORT, al
+        jmp page_fault_loop
+
+        ; Maps the faulting page if it belongs to page_fault_loop's pages.
+        ; Only installed for VMs with vm_page_faults. The pages are described
+        ; by struct fault_shared at the start of shared memory:
+        ;
+        ; [+0]:  first page
+        ; [+8]:  number of pages
+        ; [+16]: GPA of the PTE of the first page
+page_fault_handler:
+        push rax
+        push rcx
+        push rdx
+        mov ecx, SHARED_BASE
+        mov rax, cr2
+        mov rdx, rax
+        sub rdx, [rcx]
+        jb .foreign
+        shr rdx, 12
+        cmp rdx, [rcx + 8]
+        jae .foreign
+        and rax, -4096
+        or rax, 0x63            ; present, writable, dirty, accessed
+        mov rcx, [rcx + 16]
+        mov [rcx + rdx * 8], rax
+        pop rdx
+        pop rcx
+        pop rax
+        add rsp, 8              ; error code
+        iretq
+.foreign:
+        pop rdx
+        pop rcx
+        pop rax
+        pop rdx
+        mov eax, 14
+        jmp exception
+
+        ; Address space switch benchmark. Switches round-robin between the
+        ; CR3 values in an array and reads one qword from each of r9 pages
+        ; after every switch, which refills the TLB if the switch flushed it.
+        ;
+        ; rsi: array of CR3 values
+        ; rdi: number of CR3 values
+        ; r8:  first page to read, mapped with 4K pages
+        ; r9:  pages to read, must not be zero
+        ; r10: 0 = write CR3, 1 = INVPCID the new PCID first, 2 = don't switch
+        ; r15: switches
+        ; r14: TSC cycles spent reading the pages
+        ; r13: TSC cycles spent switching
+cr3_switch_loop:
+        mov rax, [rsi]          ; start in the first address space
+        mov cr3, rax
+        xor ebx, ebx
+.switch:
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        mov r11, rax
+        cmp r10, 2
+        je .switched
+
+        mov rax, [rsi + rbx * 8]
+        cmp r10, 1
+        jne .write_cr3
+        mov rdx, rax
+        and edx, 0xfff
+        push 0                  ; INVPCID descriptor: PCID, linear address
+        push rdx
+        mov ecx, 1              ; single-context invalidation
+        invpcid rcx, [rsp]
+        add rsp, 16
+.write_cr3:
+        mov cr3, rax
+
+.switched:
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        mov r12, rax
+        sub rax, r11
+        add r13, rax
+
+        xor ecx, ecx
+.read:
+        mov rax, rcx
+        shl rax, 12
+        mov rax, [r8 + rax]
+        inc rcx
+        cmp rcx, r9
+        jb .read
+
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        sub rax, r12
+        add r14, rax
+        inc r15
+
+        inc rbx
+        cmp rbx, rdi
+        jb .switch
+        xor ebx, ebx
+        jmp .switch
+
+        ; Reads an MSR over and over, or writes back the value it read
+        ; first.
+        ;
+        ; rsi: MSR index
+        ; rdi: 1 = write instead of read
+        ; r15: accesses
+msr_loop:
+        mov ecx, esi
+        rdmsr
+        test rdi, rdi
+        jnz .write
+.read:
+        rdmsr
+        inc r15
+        jmp .read
+.write:
+        wrmsr
+        inc r15
+        jmp .write
+
+        ; Reads the TSC over and over.
+        ;
+        ; r15: reads
+        ; r14: last TSC value
+tsc_loop:
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        mov r14, rax
+        inc r15
+        jmp tsc_loop
+
+        ; Reads kvmclock over and over, the way a guest kernel does.
+        ;
+        ; rsi: struct pvclock_vcpu_time_info, enabled with MSR_KVM_SYSTEM_TIME_NEW
+        ; r15: reads
+        ; r14: last kvmclock value in ns
+kvmclock_loop:
+        mov r8d, [rsi]          ; version, odd while KVM updates the structure
+        test r8d, 1
+        jnz kvmclock_loop
+        lfence
+        rdtsc
+        shl rdx, 32
+        or rax, rdx
+        sub rax, [rsi + 8]      ; tsc_timestamp
+        movsx ecx, byte [rsi + 28] ; tsc_shift
+        test ecx, ecx
+        js .shift_right
+        shl rax, cl
+        jmp .scale
+.shift_right:
+        neg ecx
+        shr rax, cl
+.scale:
+        mov edx, [rsi + 24]     ; tsc_to_system_mul
+        mul rdx
+        shrd rax, rdx, 32
+        add rax, [rsi + 16]     ; system_time
+        lfence
+        cmp r8d, [rsi]
+        jne kvmclock_loop
+        mov r14, rax
+        inc r15
+        jmp kvmclock_loop
+
+        ; Samples the steal time that KVM reports to the guest after every
+        ; iteration. An aligned qword read is atomic, so the version field
+        ; isn't needed for the steal counter alone.
+        ;
+        ; rsi: struct kvm_steal_time, enabled with MSR_KVM_STEAL_TIME
+        ; rdi: 1 = split lock in every iteration like slack_off
+        ; r15: iterations
+        ; r14: last steal time in ns
+steal_loop:
+        test rdi, rdi
+        jz .sample
+        mov rbx, 0x16c
+        lock bts qword [scratchspace + 0x54], rbx
+.sample:
+        inc r15
+        mov r14, [rsi]
+        jmp steal_loop
+
+        ; With split lock detection enabled in MSR_TEST_CTRL, a split lock
+        ; raises #AC before it executes. Count it in r14, turn detection off
+        ; and single-step the locked instruction. debug_handler turns
+        ; detection back on after it.
+alignment_check_handler:
+        inc r14
+        push rax
+        push rcx
+        push rdx
+        mov ecx, MSR_TEST_CTRL
+        xor eax, eax
+        xor edx, edx
+        wrmsr
+        pop rdx
+        pop rcx
+        pop rax
+        add rsp, 8              ; error code
+        or qword [rsp + 16], RFLAGS_TF
+        iretq
+
+debug_handler:
+        push rax
+        push rcx
+        push rdx
+        mov ecx, MSR_TEST_CTRL
+        mov eax, SPLIT_LOCK_DETECT
+        xor edx, edx
+        wrmsr
+        pop rdx
+        pop rcx
+        pop rax
+        and qword [rsp + 16], ~RFLAGS_TF
+        iretq
+
+        ; One 16-byte stub per exception vector. They report the exception
+        ; to the host at EXCEPTION_PORT, which doesn't resume the guest:
+        ;
+        ; rax: vector, rbx: RIP, rcx: CR2, rdx: error code
+        ALIGN 16
+exception_stubs:
+%assign vector 0
+%rep 32
+        ALIGN 16
+%if vector == 8 || (vector >= 10 && vector <= 14) || vector == 17 || vector == 21 || vector == 29 || vector == 30
+        pop rdx
+%else
+        xor edx, edx
+%endif
+        mov eax, vector
+        jmp exception
+%assign vector vector + 1
+%endrep
+
+exception:
+        mov rbx, [rsp]
+        mov rcx, cr2
+        out EXCEPTION_PORT, al
+.stop:
+        hlt
+        jmp .stop
+
 	; Use initialized data so our .bin file has the correct size
         SECTION .data
 
@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#pragma once
+
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/* Returns the first line of a procfs/sysfs file or an empty string if it can't be read. */
+inline std::string read_first_line(std::string const &path)
+{
+  std::ifstream f { path };
+  std::string line;
+
+  std::getline(f, line);
+  return line;
+}
+
+/* Returns the value of a kernel command line parameter, "" if it has no value or "-" if it's absent. */
+inline std::string cmdline_param(std::string const &cmdline, std::string const &name)
+{
+  std::istringstream words { cmdline };
+  std::string word;
+
+  while (words >> word) {
+    if (word == name)
+      return "";
+    if (word.compare(0, name.size() + 1, name + "=") == 0)
+      return word.substr(name.size() + 1);
+  }
+
+  return "-";
+}
+
+/*
+ * Host properties that influence how much guest throughput and timer accuracy
+ * vary between runs and hosts.
+ */
+class host_fingerprint {
+  std::vector<std::pair<std::string, std::string>> values_;
+  std::vector<std::string> warnings_;
+
+  void add(std::string const &key, std::string const &value)
+  {
+    values_.emplace_back(key, value.empty() ? "-" : value);
+  }
+
+  std::string const &get(std::string const &key) const
+  {
+    static std::string const missing { "-" };
+
+    for (auto const &v : values_)
+      if (v.first == key)
+        return v.second;
+
+    return missing;
+  }
+
+public:
+
+  std::vector<std::pair<std::string, std::string>> const &values() const { return values_; }
+  std::vector<std::string> const &warnings() const { return warnings_; }
+
+  /* The fingerprint as "key=value" lines. */
+  std::string to_string() const
+  {
+    std::string s;
+
+    for (auto const &v : values_)
+      s += v.first + "=" + v.second + "\n";
+
+    return s;
+  }
+
+  /* The inverse of to_string(). */
+  static std::map<std::string, std::string> parse(std::string const &s)
+  {
+    std::map<std::string, std::string> values;
+    std::istringstream lines { s };
+    std::string line;
+
+    while (std::getline(lines, line)) {
+      auto eq = line.find('=');
+      if (eq != std::string::npos)
+        values[line.substr(0, eq)] = line.substr(eq + 1);
+    }
+
+    return values;
+  }
+
+  host_fingerprint()
+  {
+    std::string const kvm = "/sys/module/kvm/parameters/";
+    std::string const kvm_intel = "/sys/module/kvm_intel/parameters/";
+    std::string const kvm_amd = "/sys/module/kvm_amd/parameters/";
+    std::string const cpu = "/sys/devices/system/cpu/";
+    std::string const cmdline = read_first_line("/proc/cmdline");
+
+    add("kernel", read_first_line("/proc/sys/kernel/osrelease"));
+
+    add("kvm.halt_poll_ns", read_first_line(kvm + "halt_poll_ns"));
+    add("kvm.tdp_mmu", read_first_line(kvm + "tdp_mmu"));
+    add("kvm_intel.enable_apicv", read_first_line(kvm_intel + "enable_apicv"));
+    add("kvm_intel.ept", read_first_line(kvm_intel + "ept"));
+    add("kvm_intel.ple_gap", read_first_line(kvm_intel + "ple_gap"));
+    add("kvm_intel.preemption_timer", read_first_line(kvm_intel + "preemption_timer"));
+    add("kvm_amd.avic", read_first_line(kvm_amd + "avic"));
+    add("kvm_amd.npt", read_first_line(kvm_amd + "npt"));
+    add("kvm_amd.pause_filter_count", read_first_line(kvm_amd + "pause_filter_count"));
+
+    add("split_lock_detect", cmdline_param(cmdline, "split_lock_detect"));
+    add("split_lock_mitigate", read_first_line("/proc/sys/kernel/split_lock_mitigate"));
+    add("isolcpus", cmdline_param(cmdline, "isolcpus"));
+    add("nohz_full", cmdline_param(cmdline, "nohz_full"));
+
+    add("cpufreq.governor", read_first_line(cpu + "cpu0/cpufreq/scaling_governor"));
+    add("intel_pstate.no_turbo", read_first_line(cpu + "intel_pstate/no_turbo"));
+    add("cpufreq.boost", read_first_line(cpu + "cpufreq/boost"));
+    add("smt.active", read_first_line(cpu + "smt/active"));
+    add("clocksource", read_first_line("/sys/devices/system/clocksource/clocksource0/current_clocksource"));
+
+    if (get("cpufreq.governor") != "-" and get("cpufreq.governor") != "performance")
+      warnings_.push_back("cpufreq governor is '" + get("cpufreq.governor") +
+                          "', guest throughput depends on the current frequency");
+
+    if (get("intel_pstate.no_turbo") == "0" or get("cpufreq.boost") == "1")
+      warnings_.push_back("turbo is enabled, guest throughput depends on thermal and power headroom");
+
+    if (get("smt.active") == "1")
+      warnings_.push_back("SMT is active, sibling threads compete for the core");
+
+    if (get("clocksource") != "tsc")
+      warnings_.push_back("clocksource is '" + get("clocksource") + "', timer reads are slow and may be less precise");
+
+    if (get("isolcpus") == "-" and get("nohz_full") == "-")
+      warnings_.push_back("no isolated CPUs, the vCPU thread shares its CPU with other tasks");
+
+    if (get("split_lock_mitigate") == "1")
+      warnings_.push_back("split lock mitigation is on, the split lock loop is throttled by the host kernel");
+  }
+};
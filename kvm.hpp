@@ -9,10 +9,14 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <linux/kvm.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -43,8 +47,8 @@ public:
     die_on(fd_ < 0, "fd create");
   }
 
-  fd_wrapper(const char *fname, int flags)
-    : fd_(open(fname, flags))
+  fd_wrapper(const char *fname, int flags, mode_t mode = 0644)
+    : fd_(open(fname, flags, mode))
   {
     die_on(fd_ < 0, "open");
   }
@@ -97,6 +101,53 @@ public:
     return sregs;
   }
 
+  /* Like get_msr(), but returns false instead of dying if KVM doesn't know the MSR. */
+  bool try_get_msr(uint32_t index, uint64_t &value)
+  {
+    char backing[sizeof(kvm_msrs) + sizeof(kvm_msr_entry)] {};
+    kvm_msrs *msrs = reinterpret_cast<kvm_msrs *>(backing);
+    int rc;
+
+    msrs->nmsrs = 1;
+    msrs->entries[0].index = index;
+    rc = ioctl(vcpu_fd.fd(), KVM_GET_MSRS, msrs);
+    die_on(rc < 0, "KVM_GET_MSRS");
+
+    value = msrs->entries[0].data;
+    return rc == 1;
+  }
+
+  uint64_t get_msr(uint32_t index)
+  {
+    uint64_t value;
+
+    die_on(not try_get_msr(index, value), "KVM_GET_MSRS");
+    return value;
+  }
+
+  void set_msr(uint32_t index, uint64_t value)
+  {
+    char backing[sizeof(kvm_msrs) + sizeof(kvm_msr_entry)] {};
+    kvm_msrs *msrs = reinterpret_cast<kvm_msrs *>(backing);
+
+    msrs->nmsrs = 1;
+    msrs->entries[0].index = index;
+    msrs->entries[0].data = value;
+    die_on(ioctl(vcpu_fd.fd(), KVM_SET_MSRS, msrs) != 1, "KVM_SET_MSRS");
+  }
+
+  kvm_fpu get_fpu()
+  {
+    kvm_fpu fpu;
+    die_on(ioctl(vcpu_fd.fd(), KVM_GET_FPU, &fpu) < 0, "KVM_GET_FPU");
+    return fpu;
+  }
+
+  void set_fpu(kvm_fpu const &fpu)
+  {
+    die_on(ioctl(vcpu_fd.fd(), KVM_SET_FPU, &fpu) < 0, "KVM_SET_FPU");
+  }
+
   void set_regs(kvm_regs const &regs)
   {
     die_on(ioctl(vcpu_fd.fd(), KVM_SET_REGS, &regs) < 0, "KVM_SET_REGS");
@@ -107,6 +158,24 @@ public:
     die_on(ioctl(vcpu_fd.fd(), KVM_SET_SREGS, &sregs) < 0, "KVM_SET_SREGS");
   }
 
+  /* Change the TSC frequency the guest observes. Returns false if KVM can't scale the TSC to it. */
+  bool set_tsc_khz(uint32_t khz)
+  {
+    int rc = ioctl(vcpu_fd.fd(), KVM_SET_TSC_KHZ, (unsigned long)khz);
+
+    die_on(rc < 0 and errno != EINVAL, "KVM_SET_TSC_KHZ");
+    return rc == 0;
+  }
+
+  /* Returns the TSC frequency the guest observes. */
+  uint32_t get_tsc_khz()
+  {
+    int khz = ioctl(vcpu_fd.fd(), KVM_GET_TSC_KHZ, 0);
+
+    die_on(khz <= 0, "KVM_GET_TSC_KHZ");
+    return (uint32_t)khz;
+  }
+
 
   void set_cpuid(std::vector<kvm_cpuid_entry2> const &entries)
   {
@@ -120,6 +189,13 @@ public:
     die_on(rc != 0, "ioctl(KVM_SET_CPUID2)");
   }
 
+  void set_mp_state(uint32_t state)
+  {
+    kvm_mp_state mp_state { state };
+
+    die_on(ioctl(vcpu_fd.fd(), KVM_SET_MP_STATE, &mp_state) != 0, "ioctl(KVM_SET_MP_STATE)");
+  }
+
   void set_signal_mask(sigset_t sigset)
   {
     char backing[sizeof(kvm_signal_mask) + sizeof(unsigned long)] {};
@@ -158,6 +234,53 @@ class kvm {
 
 public:
 
+  /* Returns the KVM_CHECK_EXTENSION value for a capability of this VM. 0 means unsupported. */
+  int check_extension(int cap)
+  {
+    int rc = ioctl(vm.fd(), KVM_CHECK_EXTENSION, cap);
+
+    die_on(rc < 0, "KVM_CHECK_EXTENSION");
+    return rc;
+  }
+
+  void enable_cap(uint32_t cap, uint64_t arg0)
+  {
+    kvm_enable_cap enable {};
+
+    enable.cap = cap;
+    enable.args[0] = arg0;
+    die_on(ioctl(vm.fd(), KVM_ENABLE_CAP, &enable) < 0, "KVM_ENABLE_CAP");
+  }
+
+  /* Emulate the local APICs and interrupt controllers in the kernel. Must happen before creating vCPUs. */
+  void create_irqchip()
+  {
+    die_on(ioctl(vm.fd(), KVM_CREATE_IRQCHIP, 0) < 0, "KVM_CREATE_IRQCHIP");
+  }
+
+  /* Which MSR accesses KVM handles itself. Denied accesses exit to userspace with KVM_CAP_X86_USER_SPACE_MSR. */
+  void set_msr_filter(kvm_msr_filter const &filter)
+  {
+    die_on(ioctl(vm.fd(), KVM_X86_SET_MSR_FILTER, &filter) < 0, "KVM_X86_SET_MSR_FILTER");
+  }
+
+  /* The VM-wide kvmclock in nanoseconds. */
+  uint64_t get_clock()
+  {
+    kvm_clock_data data {};
+
+    die_on(ioctl(vm.fd(), KVM_GET_CLOCK, &data) < 0, "KVM_GET_CLOCK");
+    return data.clock;
+  }
+
+  void set_clock(uint64_t ns)
+  {
+    kvm_clock_data data {};
+
+    data.clock = ns;
+    die_on(ioctl(vm.fd(), KVM_SET_CLOCK, &data) < 0, "KVM_SET_CLOCK");
+  }
+
   size_t get_vcpu_mmap_size()
   {
     int size = ioctl(dev_kvm.fd(), KVM_GET_VCPU_MMAP_SIZE, 0);
@@ -0,0 +1,72 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Merge sketch files written by timer --sketch=FILE, e.g. from many hosts, and
+ * print the resulting percentiles per timeout. Files are loaded and reduced in
+ * parallel.
+ */
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "options.hpp"
+#include "sketch.hpp"
+
+int main(int argc, char **argv)
+{
+  options opts { argc, argv, false };
+  std::vector<std::string> const &files = opts.args();
+
+  if (files.empty()) {
+    fprintf(stderr, "usage: %s [--jobs=N] [--out=FILE] SKETCH...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t jobs = std::min<uint64_t>(opts.get_u64("jobs", std::max(1U, std::thread::hardware_concurrency())),
+                                     files.size());
+
+  if (jobs == 0) {
+    fprintf(stderr, "invalid value for --jobs: must be at least 1\n");
+    return EXIT_FAILURE;
+  }
+
+  std::vector<sketch_set> partial(jobs);
+  std::vector<std::thread> threads;
+
+  for (uint64_t j = 0; j < jobs; j++)
+    threads.emplace_back([j, jobs, &files, &partial] {
+        for (size_t i = j; i < files.size(); i += jobs)
+          partial[j].load(files[i].c_str());
+      });
+
+  for (auto &thread : threads)
+    thread.join();
+
+  // Reduce the partial results pairwise, which again runs in parallel.
+  for (uint64_t stride = 1; stride < jobs; stride *= 2) {
+    threads.clear();
+
+    for (uint64_t j = 0; j + stride < jobs; j += 2 * stride)
+      threads.emplace_back([j, stride, &partial] { partial[j].merge(partial[j + stride]); });
+
+    for (auto &thread : threads)
+      thread.join();
+  }
+
+  sketch_set const &fleet = partial[0];
+
+  if (opts.has("out"))
+    fleet.save(opts.get("out", "").c_str());
+
+  printf("%10s %-13s %12s %12s %12s %12s %12s\n", "timeout_ms", "metric", "samples", "p50", "p90", "p99", "p99.9");
+  for (auto const &s : fleet.series())
+    printf("%10.3f %-13s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n",
+           s.first.first / 1e6, sketch_metric_names[s.first.second], s.second.total(), s.second.quantile(0.5),
+           s.second.quantile(0.9), s.second.quantile(0.99), s.second.quantile(0.999));
+
+  return 0;
+}
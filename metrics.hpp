@@ -0,0 +1,257 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#pragma once
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "kvm.hpp"
+#include "result_log.hpp"
+#include "sketch.hpp"
+
+/*
+ * A counter with a single writer. Increments are a plain load and store, so
+ * the writer never executes a locked instruction, and readers on other
+ * threads still see consistent values.
+ */
+class local_counter {
+  std::atomic<uint64_t> value_ { 0 };
+
+public:
+
+  void add(uint64_t n = 1) { value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+  uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+};
+
+inline char const *exit_reason_name(unsigned reason)
+{
+  switch (reason) {
+  case KVM_EXIT_IO:           return "io";
+  case KVM_EXIT_HLT:          return "hlt";
+  case KVM_EXIT_MMIO:         return "mmio";
+  case KVM_EXIT_SHUTDOWN:     return "shutdown";
+  case KVM_EXIT_FAIL_ENTRY:   return "fail_entry";
+  case KVM_EXIT_INTR:         return "intr";
+  case KVM_EXIT_INTERNAL_ERROR: return "internal_error";
+  case KVM_EXIT_X86_RDMSR:    return "x86_rdmsr";
+  case KVM_EXIT_X86_WRMSR:    return "x86_wrmsr";
+  case KVM_EXIT_X86_BUS_LOCK: return "x86_bus_lock";
+  default:                    return nullptr;
+  }
+}
+
+/* Live counters of one vCPU thread. Only that thread updates them. */
+struct vcpu_metrics {
+  static const unsigned exit_reasons = 64;
+  static const unsigned reps_buckets = 32;    /* Upper bounds 2^0 .. 2^31 reps/ms */
+
+  local_counter slices;
+  local_counter reps;
+  local_counter bus_lock_exits;
+  local_counter exits[exit_reasons];
+
+  local_counter reps_per_ms[reps_buckets + 1];  /* Last bucket is +Inf */
+  local_counter reps_per_ms_milli_sum;
+
+  local_counter overshoot_ns[sketch::buckets];
+  local_counter overshoot_ns_sum;
+
+  void count_exit(unsigned reason)
+  {
+    if (reason < exit_reasons)
+      exits[reason].add();
+    if (reason == KVM_EXIT_X86_BUS_LOCK)
+      bus_lock_exits.add();
+  }
+
+  void count_slice(slice_record const &record)
+  {
+    double rate = record[col_wall_ns] > 0 ? record[col_reps] * 1e6 / record[col_wall_ns] : 0;
+    unsigned bucket = 0;
+
+    while (bucket < reps_buckets and rate > double(uint64_t(1) << bucket))
+      bucket++;
+
+    uint64_t overshoot = std::max<int64_t>(record[col_overshoot_ns], 0);
+
+    slices.add();
+    reps.add(record[col_reps]);
+    reps_per_ms[bucket].add();
+    reps_per_ms_milli_sum.add(static_cast<uint64_t>(rate * 1000));
+    overshoot_ns[sketch::bucket_of(overshoot)].add();
+    overshoot_ns_sum.add(overshoot);
+  }
+};
+
+/* Render the metrics of all vCPUs in the Prometheus text exposition format. */
+inline std::string prometheus_text(std::vector<vcpu_metrics *> const &vcpus)
+{
+  std::string out;
+  char line[256];
+
+  auto header = [&out] (char const *name, char const *type, char const *help) {
+    out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+  };
+
+  auto counter = [&] (char const *name, char const *help, local_counter vcpu_metrics::*member) {
+    header(name, "counter", help);
+    for (size_t i = 0; i < vcpus.size(); i++) {
+      snprintf(line, sizeof(line), "%s{vcpu=\"%zu\"} %" PRIu64 "\n", name, i, (vcpus[i]->*member).get());
+      out += line;
+    }
+  };
+
+  counter("kvm_timer_slices_total", "Time slices run.", &vcpu_metrics::slices);
+  counter("kvm_timer_reps_total", "Guest loop iterations.", &vcpu_metrics::reps);
+  counter("kvm_timer_bus_lock_exits_total", "Bus lock exits (only with --bus-lock-exit).",
+          &vcpu_metrics::bus_lock_exits);
+
+  header("kvm_timer_exits_total", "counter", "Returns from KVM_RUN by exit reason.");
+  for (size_t i = 0; i < vcpus.size(); i++)
+    for (unsigned r = 0; r < vcpu_metrics::exit_reasons; r++) {
+      uint64_t n = vcpus[i]->exits[r].get();
+      if (n == 0)
+        continue;
+
+      char const *name = exit_reason_name(r);
+      std::string reason = name ? name : std::to_string(r);
+
+      snprintf(line, sizeof(line), "kvm_timer_exits_total{vcpu=\"%zu\",reason=\"%s\"} %" PRIu64 "\n", i,
+               reason.c_str(), n);
+      out += line;
+    }
+
+  header("kvm_timer_reps_per_ms", "histogram", "Guest throughput per time slice.");
+  for (size_t i = 0; i < vcpus.size(); i++) {
+    uint64_t cumulative = 0;
+
+    for (unsigned b = 0; b <= vcpu_metrics::reps_buckets; b++) {
+      cumulative += vcpus[i]->reps_per_ms[b].get();
+
+      if (b < vcpu_metrics::reps_buckets)
+        snprintf(line, sizeof(line), "kvm_timer_reps_per_ms_bucket{vcpu=\"%zu\",le=\"%" PRIu64 "\"} %" PRIu64 "\n",
+                 i, uint64_t(1) << b, cumulative);
+      else
+        snprintf(line, sizeof(line), "kvm_timer_reps_per_ms_bucket{vcpu=\"%zu\",le=\"+Inf\"} %" PRIu64 "\n",
+                 i, cumulative);
+      out += line;
+    }
+
+    snprintf(line, sizeof(line), "kvm_timer_reps_per_ms_sum{vcpu=\"%zu\"} %.3f\nkvm_timer_reps_per_ms_count{vcpu=\"%zu\"} %" PRIu64 "\n",
+             i, vcpus[i]->reps_per_ms_milli_sum.get() / 1e3, i, cumulative);
+    out += line;
+  }
+
+  header("kvm_timer_overshoot_seconds", "summary", "How much later than requested time slices ended.");
+  for (size_t i = 0; i < vcpus.size(); i++) {
+    sketch overshoot;
+
+    for (unsigned b = 0; b < sketch::buckets; b++)
+      if (uint64_t n = vcpus[i]->overshoot_ns[b].get())
+        overshoot.add_bucket(b, n);
+
+    for (double q : { 0.5, 0.9, 0.99, 0.999 }) {
+      snprintf(line, sizeof(line), "kvm_timer_overshoot_seconds{vcpu=\"%zu\",quantile=\"%g\"} %.9f\n", i, q,
+               overshoot.quantile(q) / 1e9);
+      out += line;
+    }
+
+    snprintf(line, sizeof(line), "kvm_timer_overshoot_seconds_sum{vcpu=\"%zu\"} %.9f\nkvm_timer_overshoot_seconds_count{vcpu=\"%zu\"} %" PRIu64 "\n",
+             i, vcpus[i]->overshoot_ns_sum.get() / 1e9, i, overshoot.total());
+    out += line;
+  }
+
+  return out;
+}
+
+/*
+ * Serves the current metrics on a Unix domain socket. Clients that send an
+ * HTTP GET request get an HTTP response, everybody else gets the plain text.
+ */
+class metrics_server {
+  std::vector<vcpu_metrics *> vcpus_;
+  std::string path_;
+  fd_wrapper listen_fd_ { socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) };
+  std::atomic<bool> stop_ { false };
+  std::thread thread_;
+
+  void serve(int fd)
+  {
+    struct pollfd pfd { fd, POLLIN, 0 };
+    char request[512];
+    ssize_t len = 0;
+
+    // Give HTTP clients a moment to send their request.
+    if (poll(&pfd, 1, 100) == 1)
+      len = read(fd, request, sizeof(request));
+
+    std::string body = prometheus_text(vcpus_);
+    std::string response;
+
+    if (len >= 4 and std::string(request, 4) == "GET ")
+      response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                 std::to_string(body.size()) + "\r\n\r\n";
+    response += body;
+
+    for (size_t off = 0; off < response.size();) {
+      ssize_t n = send(fd, response.data() + off, response.size() - off, MSG_NOSIGNAL);
+      if (n <= 0)
+        break;
+      off += n;
+    }
+  }
+
+  void accept_loop()
+  {
+    while (not stop_.load(std::memory_order_relaxed)) {
+      struct pollfd pfd { listen_fd_.fd(), POLLIN, 0 };
+
+      if (poll(&pfd, 1, 200) != 1)
+        continue;
+
+      int fd = accept4(listen_fd_.fd(), nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0)
+        continue;
+
+      serve(fd);
+      close(fd);
+    }
+  }
+
+public:
+
+  metrics_server(std::string const &path, std::vector<vcpu_metrics *> const &vcpus)
+    : vcpus_(vcpus), path_(path)
+  {
+    struct sockaddr_un addr {};
+
+    addr.sun_family = AF_UNIX;
+    die_on(path.size() >= sizeof(addr.sun_path), "metrics socket path too long");
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    unlink(path.c_str());
+    die_on(bind(listen_fd_.fd(), reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0, "bind");
+    die_on(listen(listen_fd_.fd(), 16) < 0, "listen");
+
+    thread_ = std::thread { &metrics_server::accept_loop, this };
+  }
+
+  metrics_server(metrics_server const &) = delete;
+
+  ~metrics_server()
+  {
+    stop_ = true;
+    thread_.join();
+    unlink(path_.c_str());
+  }
+};
@@ -0,0 +1,178 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <linux/kvm.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "kvm.hpp"
+
+/* The signal that ends a time slice of native execution. */
+static const int native_timer_signal = SIGALRM;
+
+/* Where the timer signal handler leaves the interrupted thread. */
+static thread_local sigjmp_buf native_exit;
+static thread_local kvm_regs native_regs;
+
+static void native_timer_handler(int, siginfo_t *, void *ctx)
+{
+  auto const &gregs = static_cast<ucontext_t *>(ctx)->uc_mcontext.gregs;
+
+  native_regs.rax = gregs[REG_RAX];
+  native_regs.rbx = gregs[REG_RBX];
+  native_regs.rcx = gregs[REG_RCX];
+  native_regs.rdx = gregs[REG_RDX];
+  native_regs.rsi = gregs[REG_RSI];
+  native_regs.rdi = gregs[REG_RDI];
+  native_regs.rsp = gregs[REG_RSP];
+  native_regs.rbp = gregs[REG_RBP];
+  native_regs.r8  = gregs[REG_R8];
+  native_regs.r9  = gregs[REG_R9];
+  native_regs.r10 = gregs[REG_R10];
+  native_regs.r11 = gregs[REG_R11];
+  native_regs.r12 = gregs[REG_R12];
+  native_regs.r13 = gregs[REG_R13];
+  native_regs.r14 = gregs[REG_R14];
+  native_regs.r15 = gregs[REG_R15];
+  native_regs.rip = gregs[REG_RIP];
+  native_regs.rflags = gregs[REG_EFL];
+
+  siglongjmp(native_exit, 1);
+}
+
+/*
+ * Load the general purpose registers from args and jump to entry. The guest
+ * workloads never return, so the only way back is the timer signal.
+ */
+[[noreturn]] static void native_enter(uint64_t entry, kvm_regs const *args)
+{
+  asm volatile ("push %[entry]\n\t"
+                "mov 0x08(%%rax), %%rbx\n\t"
+                "mov 0x10(%%rax), %%rcx\n\t"
+                "mov 0x18(%%rax), %%rdx\n\t"
+                "mov 0x20(%%rax), %%rsi\n\t"
+                "mov 0x28(%%rax), %%rdi\n\t"
+                "mov 0x38(%%rax), %%rbp\n\t"
+                "mov 0x40(%%rax), %%r8\n\t"
+                "mov 0x48(%%rax), %%r9\n\t"
+                "mov 0x50(%%rax), %%r10\n\t"
+                "mov 0x58(%%rax), %%r11\n\t"
+                "mov 0x60(%%rax), %%r12\n\t"
+                "mov 0x68(%%rax), %%r13\n\t"
+                "mov 0x70(%%rax), %%r14\n\t"
+                "mov 0x78(%%rax), %%r15\n\t"
+                "mov 0x00(%%rax), %%rax\n\t"
+                "ret"
+                :: [entry] "r" (entry), "a" (args)
+                : "memory");
+  __builtin_unreachable();
+}
+
+/*
+ * Runs the position-independent guest workloads directly on the host. This
+ * uses the same time slice mechanism as timeout_vm, but the timer signal is
+ * handled and jumps out of the workload instead of interrupting KVM_RUN.
+ *
+ * Only workloads that don't use privileged instructions can run this way.
+ */
+class native_runner {
+  size_t image_size_;
+  size_t shared_size_;
+  char *image_;
+  void *shared_;
+
+  timer_t timer;
+
+public:
+
+  template <typename T>
+  T *shared()
+  {
+    return static_cast<T *>(shared_);
+  }
+
+  /* The workloads see shared memory at its host address. */
+  uint64_t shared_gpa() const { return reinterpret_cast<uintptr_t>(shared_); }
+
+  template <typename REP, typename PERIOD>
+  void arm_timer(std::chrono::duration<REP, PERIOD> rel_timeout)
+  {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(rel_timeout);
+
+    struct itimerspec tspec = {
+      .it_interval = {},
+      .it_value = {
+        .tv_sec = static_cast<time_t>(ns.count() / 1000000000L),
+        .tv_nsec = static_cast<long>(ns.count() % 1000000000L),
+      },
+    };
+
+    die_on(timer_settime(timer, 0 /* relative timeout */, &tspec, nullptr) != 0, "failed to set timer");
+  }
+
+  /*
+   * Runs the workload at the given offset into the image until the timer
+   * expires and returns the register state at that point.
+   */
+  kvm_regs run(uint64_t entry_offset, kvm_regs args)
+  {
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, native_timer_signal);
+
+    if (sigsetjmp(native_exit, 1 /* restore the blocked signal mask */) == 0) {
+      die_on(pthread_sigmask(SIG_UNBLOCK, &sigset, nullptr) != 0, "failed to unblock signal");
+      native_enter(reinterpret_cast<uintptr_t>(image_) + entry_offset, &args);
+    }
+
+    return native_regs;
+  }
+
+  native_runner(void const *image, size_t image_size, size_t shared_size)
+    : image_size_(image_size), shared_size_(shared_size)
+  {
+    // The workloads modify their own data, so the copy has to be writable and executable.
+    image_ = static_cast<char *>(mmap(nullptr, image_size, PROT_READ | PROT_WRITE | PROT_EXEC,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    die_on(image_ == MAP_FAILED, "mmap");
+    memcpy(image_, image, image_size);
+
+    shared_ = mmap(nullptr, shared_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    die_on(shared_ == MAP_FAILED, "mmap");
+
+    struct sigaction sa {};
+    sa.sa_sigaction = native_timer_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    die_on(sigaction(native_timer_signal, &sa, nullptr) != 0, "sigaction");
+
+    // The signal is only unblocked while a workload runs.
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, native_timer_signal);
+    die_on(pthread_sigmask(SIG_BLOCK, &sigset, nullptr) != 0, "failed to block signal");
+
+    struct sigevent sevp {};
+    sevp.sigev_notify = SIGEV_THREAD_ID;
+    sevp._sigev_un._tid = gettid();
+    sevp.sigev_signo = native_timer_signal;
+    die_on(timer_create(CLOCK_MONOTONIC, &sevp, &timer) != 0, "failed to create timer");
+  }
+
+  native_runner(native_runner const &) = delete;
+
+  ~native_runner()
+  {
+    die_on(timer_delete(timer) != 0, "timer_delete");
+    die_on(munmap(shared_, shared_size_) < 0, "munmap");
+    die_on(munmap(image_, image_size_) < 0, "munmap");
+  }
+};
@@ -20,7 +20,7 @@ stdenv.mkDerivation {
   dontConfigure = true;
   installPhase = ''
     mkdir -p $out/bin
-    install -m 0755 -t $out/bin timer
+    install -m 0755 -t $out/bin timer analyze merge
   '';
 
   meta = {
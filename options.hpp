@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Minimal command line parsing. The first argument optionally selects a mode,
+ * all following arguments are either --name=value options, --flag options or
+ * positional arguments. Tools without modes pass with_mode = false.
+ */
+class options {
+  std::string mode_ { "sweep" };
+  std::map<std::string, std::string> values_;
+  std::vector<std::string> args_;
+
+  [[noreturn]] static void invalid(std::string const &name, std::string const &value)
+  {
+    fprintf(stderr, "invalid value for --%s: '%s'\n", name.c_str(), value.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+public:
+
+  options(int argc, char **argv, bool with_mode = true)
+  {
+    int i = 1;
+
+    if (with_mode and i < argc and argv[i][0] != '-')
+      mode_ = argv[i++];
+
+    for (; i < argc; i++) {
+      std::string arg { argv[i] };
+
+      if (arg.compare(0, 2, "--") != 0) {
+        args_.push_back(arg);
+        continue;
+      }
+
+      auto eq = arg.find('=');
+      if (eq == std::string::npos)
+        values_[arg.substr(2)] = "";
+      else
+        values_[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+    }
+  }
+
+  std::string const &mode() const { return mode_; }
+  std::vector<std::string> const &args() const { return args_; }
+
+  bool has(std::string const &name) const { return values_.count(name) != 0; }
+
+  std::string get(std::string const &name, std::string const &def) const
+  {
+    auto it = values_.find(name);
+    return it == values_.end() ? def : it->second;
+  }
+
+  uint64_t get_u64(std::string const &name, uint64_t def) const
+  {
+    auto it = values_.find(name);
+    if (it == values_.end())
+      return def;
+
+    char *end = nullptr;
+    uint64_t value = strtoull(it->second.c_str(), &end, 0);
+    if (it->second.empty() or *end != '\0')
+      invalid(name, it->second);
+
+    return value;
+  }
+
+  double get_double(std::string const &name, double def) const
+  {
+    auto it = values_.find(name);
+    if (it == values_.end())
+      return def;
+
+    char *end = nullptr;
+    double value = strtod(it->second.c_str(), &end);
+    if (it->second.empty() or *end != '\0')
+      invalid(name, it->second);
+
+    return value;
+  }
+};
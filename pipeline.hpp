@@ -0,0 +1,186 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "result_log.hpp"
+#include "sketch.hpp"
+
+/*
+ * A bounded single-producer single-consumer ring. All memory is allocated up
+ * front, so pushing never allocates. When the ring is full, records are dropped
+ * and counted instead of blocking the producer.
+ */
+template <typename T>
+class spsc_ring {
+  static const size_t cacheline = 64;
+
+  std::vector<T> slots_;
+  uint64_t mask_;
+
+  /* Producer and consumer indices live on separate cache lines. */
+  std::atomic<uint64_t> head_ { 0 };    /* Written by the producer */
+  char pad0_[cacheline - sizeof(std::atomic<uint64_t>)];
+  std::atomic<uint64_t> tail_ { 0 };    /* Written by the consumer */
+  char pad1_[cacheline - sizeof(std::atomic<uint64_t>)];
+  std::atomic<uint64_t> dropped_ { 0 }; /* Written by the producer */
+
+public:
+
+  spsc_ring(size_t capacity)
+    : slots_(capacity), mask_(capacity - 1)
+  {
+    die_on(capacity == 0 or (capacity & (capacity - 1)) != 0, "ring capacity must be a power of two");
+  }
+
+  spsc_ring(spsc_ring const &) = delete;
+
+  uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+  /* Producer side. Returns false if the record was dropped. */
+  bool push(T const &value)
+  {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+
+    if (head - tail_.load(std::memory_order_acquire) == slots_.size()) {
+      dropped_.store(dropped_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return false;
+    }
+
+    slots_[head & mask_] = value;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  /* Consumer side. Hands all available records to fn and returns how many there were. */
+  template <typename FN>
+  size_t drain(FN fn)
+  {
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    uint64_t head = head_.load(std::memory_order_acquire);
+
+    for (uint64_t i = tail; i != head; i++)
+      fn(slots_[i & mask_]);
+
+    tail_.store(head, std::memory_order_release);
+    return head - tail;
+  }
+};
+
+/*
+ * Collects slice records from one ring per measuring thread on a separate
+ * thread. Records are formatted and written to stdout and to the result log in
+ * batches and added to the sketches, so the measuring threads never do I/O.
+ */
+class result_collector {
+  std::vector<std::unique_ptr<spsc_ring<slice_record>>> rings_;
+  result_log_writer *log_;
+  sketch_set *sketches_;
+  bool text_;
+
+  std::atomic<bool> stop_ { false };
+  std::thread thread_;
+
+  size_t drain_all(std::string &batch)
+  {
+    size_t total = 0;
+
+    for (size_t source = 0; source < rings_.size(); source++) {
+      total += rings_[source]->drain([this, source, &batch] (slice_record const &record) {
+          if (log_)
+            log_->append(record);
+
+          if (sketches_)
+            sketches_->add(record);
+
+          if (not text_)
+            return;
+
+          char line[128];
+          int len;
+
+          if (rings_.size() > 1)
+            len = snprintf(line, sizeof(line), "vm %zu: ", source);
+          else
+            len = 0;
+
+          len += snprintf(line + len, sizeof(line) - len, "timeout %" PRId64 "ms (took %" PRId64 "ms) -> reps %" PRId64 "\n",
+                          record[col_timeout_ns] / 1000000, record[col_wall_ns] / 1000000, record[col_reps]);
+          batch.append(line, std::min<size_t>(len, sizeof(line) - 1));
+        });
+    }
+
+    return total;
+  }
+
+  void collect()
+  {
+    std::string batch;
+
+    for (;;) {
+      bool stopping = stop_.load(std::memory_order_acquire);
+      size_t drained = drain_all(batch);
+
+      if (not batch.empty()) {
+        fwrite(batch.data(), 1, batch.size(), stdout);
+        fflush(stdout);
+        batch.clear();
+      }
+
+      // Producers are done before stop_ is set, so an empty pass after that means we are done.
+      if (stopping and drained == 0)
+        break;
+
+      if (drained == 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds { 10 });
+    }
+  }
+
+public:
+
+  result_collector(size_t sources, size_t capacity, result_log_writer *log, sketch_set *sketches, bool text)
+    : log_(log), sketches_(sketches), text_(text)
+  {
+    for (size_t i = 0; i < sources; i++)
+      rings_.emplace_back(new spsc_ring<slice_record> { capacity });
+
+    thread_ = std::thread { &result_collector::collect, this };
+  }
+
+  result_collector(result_collector const &) = delete;
+
+  spsc_ring<slice_record> &ring(size_t source) { return *rings_[source]; }
+
+  /* Drain everything that is left and stop the collector thread. Returns the number of dropped records. */
+  uint64_t finish()
+  {
+    uint64_t dropped = 0;
+
+    stop_.store(true, std::memory_order_release);
+    thread_.join();
+
+    for (size_t source = 0; source < rings_.size(); source++) {
+      if (rings_[source]->dropped() != 0)
+        fprintf(stderr, "vm %zu: dropped %" PRIu64 " records\n", source, rings_[source]->dropped());
+
+      dropped += rings_[source]->dropped();
+    }
+
+    return dropped;
+  }
+
+  ~result_collector()
+  {
+    if (thread_.joinable())
+      finish();
+  }
+};
@@ -0,0 +1,239 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kvm.hpp"
+
+/*
+ * The result log stores one record per time slice in a memory-mapped,
+ * append-only file. Records are stored column by column in fixed-size blocks,
+ * so the analyzer can run reductions over a column without copying it.
+ *
+ * File layout:
+ *
+ *   log_file_header
+ *   metadata, NUL-terminated text   (padded to log_page_size)
+ *   block 0: log_block_header       (padded to log_page_size)
+ *            column 0: int64_t[log_block_rows]
+ *            ...
+ *            column log_columns - 1
+ *   block 1: ...
+ */
+
+enum log_column : unsigned {
+  col_timeout_ns,
+  col_reps,
+  col_wall_ns,       /* steady_clock time around KVM_RUN */
+  col_cpu_ns,        /* CPU time of the vCPU thread in the same interval */
+  col_overshoot_ns,  /* wall_ns - timeout_ns */
+  col_exit_reason,   /* KVM exit reason that ended the slice */
+  col_exits,         /* Number of returns from KVM_RUN during the slice */
+
+  log_columns,
+};
+
+static char const *const log_column_names[log_columns] {
+  "timeout_ns", "reps", "wall_ns", "cpu_ns", "overshoot_ns", "exit_reason", "exits",
+};
+
+struct slice_record {
+  int64_t values[log_columns];
+
+  int64_t &operator[](log_column c) { return values[c]; }
+  int64_t operator[](log_column c) const { return values[c]; }
+};
+
+static const char log_magic[8] { 'K', 'V', 'M', 'T', 'L', 'O', 'G', '1' };
+static const uint64_t log_page_size = 4096;
+static const uint64_t log_block_rows = 4096;
+static const uint64_t log_block_size = log_page_size + log_columns * log_block_rows * sizeof(int64_t);
+
+struct log_file_header {
+  char magic[8];
+  uint64_t columns;
+  uint64_t block_rows;
+};
+
+/* Free-form text about the run, e.g. the host fingerprint. */
+static const uint64_t log_metadata_size = log_page_size - sizeof(log_file_header);
+
+struct log_block_header {
+  uint64_t rows;    /* Valid rows in this block */
+};
+
+static_assert(log_block_size % log_page_size == 0, "Log blocks must be page aligned");
+
+/* Returns a pointer to a column in a mapped block. */
+inline int64_t *log_block_column(void *block, log_column c)
+{
+  return reinterpret_cast<int64_t *>(static_cast<char *>(block) + log_page_size + c * log_block_rows * sizeof(int64_t));
+}
+
+inline int64_t const *log_block_column(void const *block, log_column c)
+{
+  return log_block_column(const_cast<void *>(block), c);
+}
+
+/*
+ * Appends slice records to a result log. Only the block that is currently
+ * being filled is mapped. If the file already exists, new records are appended
+ * to it.
+ */
+class result_log_writer {
+  fd_wrapper fd_;
+  uint64_t blocks_ = 0;
+  void *block_ = nullptr;
+
+  log_block_header *header() { return static_cast<log_block_header *>(block_); }
+
+  void map_block(uint64_t index)
+  {
+    if (block_ != nullptr)
+      die_on(munmap(block_, log_block_size) < 0, "munmap");
+
+    block_ = mmap(nullptr, log_block_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_.fd(),
+                  log_page_size + index * log_block_size);
+    die_on(block_ == MAP_FAILED, "mmap");
+  }
+
+  void add_block()
+  {
+    die_on(ftruncate(fd_.fd(), log_page_size + (blocks_ + 1) * log_block_size) < 0, "ftruncate");
+    map_block(blocks_++);
+  }
+
+public:
+
+  /* The metadata is only written when a new file is created. */
+  result_log_writer(char const *path, std::string const &metadata = "")
+    : fd_(path, O_RDWR | O_CREAT)
+  {
+    struct stat st;
+    log_file_header file_header {};
+
+    die_on(fstat(fd_.fd(), &st) < 0, "fstat");
+
+    if (st.st_size == 0) {
+      memcpy(file_header.magic, log_magic, sizeof(log_magic));
+      file_header.columns = log_columns;
+      file_header.block_rows = log_block_rows;
+
+      die_on(pwrite(fd_.fd(), &file_header, sizeof(file_header), 0) != sizeof(file_header), "pwrite");
+
+      size_t len = std::min<size_t>(metadata.size(), log_metadata_size - 1);
+      die_on(pwrite(fd_.fd(), metadata.data(), len, sizeof(file_header)) != (ssize_t)len, "pwrite");
+
+      add_block();
+      return;
+    }
+
+    die_on(pread(fd_.fd(), &file_header, sizeof(file_header), 0) != sizeof(file_header), "pread");
+    die_on(memcmp(file_header.magic, log_magic, sizeof(log_magic)) != 0 or file_header.columns != log_columns or
+           file_header.block_rows != log_block_rows or st.st_size < (off_t)log_page_size or
+           (st.st_size - log_page_size) % log_block_size != 0, "incompatible result log");
+
+    blocks_ = (st.st_size - log_page_size) / log_block_size;
+
+    // A crash right after creating the file leaves a log without blocks.
+    if (blocks_ == 0)
+      add_block();
+    else
+      map_block(blocks_ - 1);
+  }
+
+  result_log_writer(result_log_writer const &) = delete;
+
+  void append(slice_record const &record)
+  {
+    if (header()->rows == log_block_rows)
+      add_block();
+
+    for (unsigned c = 0; c < log_columns; c++)
+      log_block_column(block_, log_column(c))[header()->rows] = record.values[c];
+
+    header()->rows++;
+  }
+
+  ~result_log_writer()
+  {
+    die_on(munmap(block_, log_block_size) < 0, "munmap");
+  }
+};
+
+/* Read-only view of a complete result log. */
+class result_log_reader {
+  void *data_;
+  size_t size_;
+  uint64_t blocks_;
+
+public:
+
+  uint64_t blocks() const { return blocks_; }
+
+  std::string metadata() const
+  {
+    char const *text = static_cast<char const *>(data_) + sizeof(log_file_header);
+    return { text, strnlen(text, log_metadata_size) };
+  }
+
+  void const *block(uint64_t i) const
+  {
+    return static_cast<char const *>(data_) + log_page_size + i * log_block_size;
+  }
+
+  uint64_t rows(uint64_t i) const
+  {
+    return static_cast<log_block_header const *>(block(i))->rows;
+  }
+
+  int64_t const *column(uint64_t i, log_column c) const { return log_block_column(block(i), c); }
+
+  uint64_t total_rows() const
+  {
+    uint64_t total = 0;
+
+    for (uint64_t i = 0; i < blocks_; i++)
+      total += rows(i);
+
+    return total;
+  }
+
+  result_log_reader(char const *path)
+  {
+    fd_wrapper fd { path, O_RDONLY };
+    struct stat st;
+
+    die_on(fstat(fd.fd(), &st) < 0, "fstat");
+    die_on(st.st_size < (off_t)log_page_size or (st.st_size - log_page_size) % log_block_size != 0,
+           "truncated result log");
+
+    size_ = st.st_size;
+    data_ = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd.fd(), 0);
+    die_on(data_ == MAP_FAILED, "mmap");
+
+    auto header = static_cast<log_file_header const *>(data_);
+    die_on(memcmp(header->magic, log_magic, sizeof(log_magic)) != 0 or header->columns != log_columns or
+           header->block_rows != log_block_rows, "incompatible result log");
+
+    blocks_ = (size_ - log_page_size) / log_block_size;
+
+    for (uint64_t i = 0; i < blocks_; i++)
+      die_on(rows(i) > log_block_rows, "corrupt result log");
+  }
+
+  result_log_reader(result_log_reader const &) = delete;
+
+  ~result_log_reader()
+  {
+    die_on(munmap(data_, size_) < 0, "munmap");
+  }
+};
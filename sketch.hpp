@@ -0,0 +1,223 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "kvm.hpp"
+#include "result_log.hpp"
+
+/*
+ * A log-linear histogram in the spirit of HdrHistogram. Values are bucketed by
+ * their power of two and then by 2^sub_bits linear sub-buckets, which bounds
+ * the relative error of quantiles to 2^-sub_bits. Values below 2^sub_bits are
+ * exact. All sketches share the same bucket layout, so merging them is adding
+ * up their counts.
+ */
+class sketch {
+public:
+  static const unsigned sub_bits = 6;
+  static const unsigned sub_buckets = 1U << sub_bits;
+  static const unsigned buckets = (64 - sub_bits + 1) * sub_buckets;
+
+private:
+  std::vector<uint64_t> counts_ = std::vector<uint64_t>(buckets);
+  uint64_t total_ = 0;
+
+public:
+
+  static unsigned bucket_of(uint64_t value)
+  {
+    if (value < sub_buckets)
+      return static_cast<unsigned>(value);
+
+    unsigned shift = 63 - __builtin_clzll(value) - sub_bits;
+    return (shift + 1) * sub_buckets + static_cast<unsigned>((value >> shift) - sub_buckets);
+  }
+
+  /* Smallest value that falls into the bucket. */
+  static uint64_t bucket_low(unsigned bucket)
+  {
+    if (bucket < sub_buckets)
+      return bucket;
+
+    unsigned shift = bucket / sub_buckets - 1;
+    return (uint64_t(sub_buckets) + bucket % sub_buckets) << shift;
+  }
+
+  /* Value that represents all values in the bucket. */
+  static uint64_t bucket_mid(unsigned bucket)
+  {
+    if (bucket < sub_buckets)
+      return bucket;
+
+    unsigned shift = bucket / sub_buckets - 1;
+    return bucket_low(bucket) + ((uint64_t(1) << shift) >> 1);
+  }
+
+  uint64_t total() const { return total_; }
+  uint64_t count(unsigned bucket) const { return counts_[bucket]; }
+
+  void add(uint64_t value, uint64_t n = 1)
+  {
+    counts_[bucket_of(value)] += n;
+    total_ += n;
+  }
+
+  void add_bucket(unsigned bucket, uint64_t n)
+  {
+    die_on(bucket >= buckets, "sketch bucket out of range");
+    counts_[bucket] += n;
+    total_ += n;
+  }
+
+  void merge(sketch const &other)
+  {
+    for (unsigned i = 0; i < buckets; i++)
+      counts_[i] += other.counts_[i];
+
+    total_ += other.total_;
+  }
+
+  /* Returns the q-quantile (0 <= q <= 1) or 0 for an empty sketch. */
+  uint64_t quantile(double q) const
+  {
+    if (total_ == 0)
+      return 0;
+
+    uint64_t rank = static_cast<uint64_t>(q * (total_ - 1));
+    uint64_t seen = 0;
+
+    for (unsigned i = 0; i < buckets; i++) {
+      seen += counts_[i];
+      if (seen > rank)
+        return bucket_mid(i);
+    }
+
+    return bucket_mid(buckets - 1);
+  }
+};
+
+enum sketch_metric : uint32_t {
+  metric_reps,
+  metric_overshoot_ns,  /* Negative overshoot is counted as 0 */
+
+  sketch_metrics,
+};
+
+static char const *const sketch_metric_names[sketch_metrics] { "reps", "overshoot_ns" };
+
+/*
+ * Distributions of every metric for every timeout. A sketch file stores only
+ * the non-empty buckets:
+ *
+ *   sketch_file_header
+ *   for every series:
+ *     sketch_series_header
+ *     sketch_file_bucket[buckets]
+ */
+static const char sketch_magic[8] { 'K', 'V', 'M', 'T', 'S', 'K', 'T', '1' };
+
+struct sketch_file_header {
+  char magic[8];
+  uint32_t sub_bits;
+  uint32_t series;
+};
+
+struct sketch_series_header {
+  int64_t timeout_ns;
+  uint32_t metric;
+  uint32_t buckets;
+};
+
+struct sketch_file_bucket {
+  uint64_t bucket;
+  uint64_t count;
+};
+
+class sketch_set {
+public:
+  typedef std::pair<int64_t, sketch_metric> key;
+
+private:
+  std::map<key, sketch> series_;
+
+public:
+
+  std::map<key, sketch> const &series() const { return series_; }
+
+  void add(slice_record const &record)
+  {
+    series_[key { record[col_timeout_ns], metric_reps }].add(record[col_reps]);
+    series_[key { record[col_timeout_ns], metric_overshoot_ns }].add(std::max<int64_t>(record[col_overshoot_ns], 0));
+  }
+
+  void merge(sketch_set const &other)
+  {
+    for (auto const &s : other.series_)
+      series_[s.first].merge(s.second);
+  }
+
+  void save(char const *path) const
+  {
+    FILE *f = fopen(path, "wb");
+    die_on(f == nullptr, "fopen");
+
+    sketch_file_header header {};
+    memcpy(header.magic, sketch_magic, sizeof(sketch_magic));
+    header.sub_bits = sketch::sub_bits;
+    header.series = series_.size();
+    die_on(fwrite(&header, sizeof(header), 1, f) != 1, "fwrite");
+
+    for (auto const &s : series_) {
+      std::vector<sketch_file_bucket> buckets;
+
+      for (unsigned i = 0; i < sketch::buckets; i++)
+        if (s.second.count(i) != 0)
+          buckets.push_back({ i, s.second.count(i) });
+
+      sketch_series_header series { s.first.first, s.first.second, static_cast<uint32_t>(buckets.size()) };
+      die_on(fwrite(&series, sizeof(series), 1, f) != 1, "fwrite");
+      die_on(fwrite(buckets.data(), sizeof(buckets[0]), buckets.size(), f) != buckets.size(), "fwrite");
+    }
+
+    die_on(fclose(f) != 0, "fclose");
+  }
+
+  /* Adds the contents of a sketch file to this set. */
+  void load(char const *path)
+  {
+    FILE *f = fopen(path, "rb");
+    die_on(f == nullptr, "fopen");
+
+    sketch_file_header header;
+    die_on(fread(&header, sizeof(header), 1, f) != 1, "truncated sketch file");
+    die_on(memcmp(header.magic, sketch_magic, sizeof(sketch_magic)) != 0 or header.sub_bits != sketch::sub_bits,
+           "incompatible sketch file");
+
+    std::vector<sketch_file_bucket> buckets;
+
+    for (uint32_t i = 0; i < header.series; i++) {
+      sketch_series_header series;
+      die_on(fread(&series, sizeof(series), 1, f) != 1, "truncated sketch file");
+      die_on(series.metric >= sketch_metrics, "unknown sketch metric");
+      die_on(series.buckets > sketch::buckets, "corrupt sketch file");
+
+      buckets.resize(series.buckets);
+      die_on(fread(buckets.data(), sizeof(buckets[0]), buckets.size(), f) != buckets.size(), "truncated sketch file");
+
+      sketch &s = series_[key { series.timeout_ns, sketch_metric(series.metric) }];
+      for (auto const &b : buckets) {
+        die_on(b.bucket >= sketch::buckets, "corrupt sketch file");
+        s.add_bucket(static_cast<unsigned>(b.bucket), b.count);
+      }
+    }
+
+    die_on(fclose(f) != 0, "fclose");
+  }
+};
@@ -0,0 +1,282 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <random>
+#include <utility>
+#include <vector>
+
+/*
+ * Returns the q-quantile (0 <= q <= 1) of values with linear interpolation
+ * between the closest ranks. The order of values is not preserved.
+ */
+inline double quantile(std::vector<double> &values, double q)
+{
+  if (values.empty())
+    return NAN;
+
+  double rank = q * (values.size() - 1);
+  size_t lo = static_cast<size_t>(rank);
+
+  std::nth_element(values.begin(), values.begin() + lo, values.end());
+  double lo_value = values[lo];
+
+  if (lo + 1 >= values.size())
+    return lo_value;
+
+  double hi_value = *std::min_element(values.begin() + lo + 1, values.end());
+  return lo_value + (rank - lo) * (hi_value - lo_value);
+}
+
+inline double mean(double const *values, size_t n)
+{
+  double sum = 0;
+
+  for (size_t i = 0; i < n; i++)
+    sum += values[i];
+
+  return n ? sum / n : NAN;
+}
+
+/* Sample standard deviation. */
+inline double stddev(double const *values, size_t n)
+{
+  if (n < 2)
+    return NAN;
+
+  double m = mean(values, n);
+  double sq = 0;
+
+  for (size_t i = 0; i < n; i++)
+    sq += (values[i] - m) * (values[i] - m);
+
+  return std::sqrt(sq / (n - 1));
+}
+
+/*
+ * Jain's fairness index: 1 if all values are equal, 1/n if a single one gets
+ * everything.
+ */
+inline double jain_index(double const *values, size_t n)
+{
+  double sum = 0, sq = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    sum += values[i];
+    sq += values[i] * values[i];
+  }
+
+  return sq > 0 ? sum * sum / (n * sq) : NAN;
+}
+
+struct linear_fit {
+  double slope;
+  double intercept;
+  double r2;        /* Coefficient of determination */
+};
+
+/* Least squares fit of y = slope * x + intercept. */
+inline linear_fit fit_linear(double const *x, double const *y, size_t n)
+{
+  double sx = 0, sy = 0, sxx = 0, sxy = 0, syy = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    sx += x[i];
+    sy += y[i];
+    sxx += x[i] * x[i];
+    sxy += x[i] * y[i];
+    syy += y[i] * y[i];
+  }
+
+  double cov = n * sxy - sx * sy;
+  double var_x = n * sxx - sx * sx;
+  double var_y = n * syy - sy * sy;
+
+  if (n < 2 or var_x == 0)
+    return { NAN, NAN, NAN };
+
+  double slope = cov / var_x;
+  return { slope, (sy - slope * sx) / n, var_y == 0 ? 1.0 : cov * cov / (var_x * var_y) };
+}
+
+/* Standard normal distribution function. */
+inline double normal_cdf(double z)
+{
+  return 0.5 * std::erfc(-z / std::sqrt(2.0));
+}
+
+/* Inverse of normal_cdf for 0 < p < 1. */
+inline double normal_quantile(double p)
+{
+  double lo = -40, hi = 40;
+
+  for (int i = 0; i < 200; i++) {
+    double mid = (lo + hi) / 2;
+    (normal_cdf(mid) < p ? lo : hi) = mid;
+  }
+
+  return (lo + hi) / 2;
+}
+
+struct rank_test {
+  double u;   /* Mann-Whitney U of the first sample */
+  double z;   /* Positive if the second sample tends to be larger */
+  double p;   /* Two-sided p-value */
+};
+
+/*
+ * Mann-Whitney U test with tie correction, using the normal approximation. It
+ * makes no assumptions about the shape of the distributions, which suits our
+ * often multimodal throughput numbers.
+ */
+inline rank_test mann_whitney(std::vector<double> const &a, std::vector<double> const &b)
+{
+  size_t n1 = a.size(), n2 = b.size(), n = n1 + n2;
+
+  if (n1 == 0 or n2 == 0)
+    return { NAN, NAN, NAN };
+
+  std::vector<std::pair<double, bool>> all;   /* (value, is from a) */
+  all.reserve(n);
+  for (double v : a)
+    all.emplace_back(v, true);
+  for (double v : b)
+    all.emplace_back(v, false);
+  std::sort(all.begin(), all.end());
+
+  double rank_sum_a = 0, ties = 0;
+
+  for (size_t i = 0; i < n;) {
+    size_t j = i;
+    while (j < n and all[j].first == all[i].first)
+      j++;
+
+    double rank = (i + 1 + j) / 2.0;    /* Average of ranks i+1 .. j */
+    double t = j - i;
+
+    for (size_t k = i; k < j; k++)
+      if (all[k].second)
+        rank_sum_a += rank;
+
+    ties += t * t * t - t;
+    i = j;
+  }
+
+  double u = rank_sum_a - n1 * (n1 + 1) / 2.0;
+  double mu = n1 * n2 / 2.0;
+  double sigma = std::sqrt(n1 * n2 / 12.0 * ((n + 1) - ties / (double(n) * (n - 1))));
+
+  if (sigma == 0)
+    return { u, 0, 1 };
+
+  double diff = mu - u;   /* Positive if b ranks higher */
+  double z = (diff - (diff > 0 ? 0.5 : diff < 0 ? -0.5 : 0)) / sigma;
+
+  return { u, z, std::erfc(std::fabs(z) / std::sqrt(2.0)) };
+}
+
+struct shift_estimate {
+  double shift;   /* Estimated b - a */
+  double lo, hi;  /* Confidence interval for the shift */
+};
+
+/*
+ * Returns the k-th smallest (from 0) of the pairwise differences b[j] - a[i]
+ * of two sorted samples without materializing them. This is the randomized
+ * selection of Monahan: row i of the difference matrix is sorted in j and
+ * shrinks as i grows, so counting the differences below a pivot is a single
+ * merge-like pass, and each round discards the candidates on the wrong side
+ * of the pivot. Expected O((n1 + n2) log(n1 n2)) time and O(n1 + n2) memory.
+ */
+inline double pairwise_difference(std::vector<double> const &a, std::vector<double> const &b, size_t k)
+{
+  struct row_bounds {
+    size_t lo, hi;    /* Candidate columns */
+    size_t lt, le;    /* Columns below and up to the pivot */
+  };
+
+  size_t n1 = a.size(), n2 = b.size();
+  std::vector<row_bounds> rows(n1, row_bounds { 0, n2, 0, 0 });
+  std::mt19937_64 rng { k };    /* Seeded by k, so the result is reproducible */
+
+  for (;;) {
+    size_t candidates = 0, skipped = 0;
+    for (auto const &r : rows) {
+      candidates += r.hi - r.lo;
+      skipped += r.lo;
+    }
+
+    /* Few enough left to select directly. */
+    if (candidates <= n1 + n2) {
+      std::vector<double> rest;
+      rest.reserve(candidates);
+      for (size_t i = 0; i < n1; i++)
+        for (size_t j = rows[i].lo; j < rows[i].hi; j++)
+          rest.push_back(b[j] - a[i]);
+
+      std::nth_element(rest.begin(), rest.begin() + (k - skipped), rest.end());
+      return rest[k - skipped];
+    }
+
+    size_t pick = std::uniform_int_distribution<size_t> { 0, candidates - 1 }(rng);
+    size_t row = 0;
+    for (; pick >= rows[row].hi - rows[row].lo; row++)
+      pick -= rows[row].hi - rows[row].lo;
+    double pivot = b[rows[row].lo + pick] - a[row];
+
+    /* Differences below and up to the pivot in each row, which only grow with i. */
+    size_t lt = 0, le = 0, j_lt = 0, j_le = 0;
+    for (size_t i = 0; i < n1; i++) {
+      while (j_lt < n2 and b[j_lt] - a[i] < pivot)
+        j_lt++;
+      while (j_le < n2 and b[j_le] - a[i] <= pivot)
+        j_le++;
+
+      rows[i].lt = j_lt;
+      rows[i].le = j_le;
+      lt += j_lt;
+      le += j_le;
+    }
+
+    if (k < lt) {
+      for (auto &r : rows)
+        r.hi = std::min(r.hi, r.lt);
+    } else if (k >= le) {
+      for (auto &r : rows)
+        r.lo = std::max(r.lo, r.le);
+    } else {
+      return pivot;
+    }
+  }
+}
+
+/*
+ * Hodges-Lehmann estimate of the shift between two samples: the median of all
+ * pairwise differences. The distribution-free confidence interval is derived
+ * from the same normal approximation as the Mann-Whitney test. Both are found
+ * by selection, so long runs don't need all n1 n2 differences in memory.
+ */
+inline shift_estimate hodges_lehmann(std::vector<double> a, std::vector<double> b, double confidence)
+{
+  size_t n1 = a.size(), n2 = b.size();
+
+  if (n1 == 0 or n2 == 0)
+    return { NAN, NAN, NAN };
+
+  std::sort(a.begin(), a.end());
+  std::sort(b.begin(), b.end());
+
+  size_t nm = n1 * n2;
+  double z = normal_quantile(1 - (1 - confidence) / 2);
+  double k = std::floor(nm / 2.0 - z * std::sqrt(n1 * n2 * (n1 + n2 + 1) / 12.0));
+  size_t lo = k < 0 ? 0 : std::min(static_cast<size_t>(k), nm - 1);
+  double median = pairwise_difference(a, b, nm / 2);
+
+  if (nm % 2 == 0)
+    median = (pairwise_difference(a, b, nm / 2 - 1) + median) / 2;
+
+  return { median, pairwise_difference(a, b, lo), pairwise_difference(a, b, nm - 1 - lo) };
+}
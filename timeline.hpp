@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/* Number of samples in the guest timeline ring. Must be a power of two. */
+static const uint64_t timeline_capacity = 65536;
+
+struct timeline_sample {
+  uint64_t tsc;     /* Guest TSC when the sample was taken */
+  uint64_t count;   /* Iterations completed at that point */
+};
+
+/*
+ * A ring of (TSC, iteration count) samples that the guest appends to every N
+ * iterations without exiting. The layout is shared with guest.asm.
+ */
+struct timeline_ring {
+  uint64_t head;    /* Number of samples written so far, never wraps */
+  uint64_t reserved;
+  timeline_sample samples[timeline_capacity];
+};
+
+static_assert((timeline_capacity & (timeline_capacity - 1)) == 0, "Timeline capacity must be a power of two");
+
+struct timeline_point {
+  double time_ms;       /* Start of the bucket relative to the first sample */
+  double reps_per_ms;   /* Guest throughput within the bucket */
+};
+
+/*
+ * Turn the samples in the ring into a throughput-versus-time curve with
+ * buckets of bucket_ms length. If the ring overflowed, the curve starts at the
+ * oldest sample that is still available.
+ */
+inline std::vector<timeline_point> decode_timeline(timeline_ring const &ring, uint32_t tsc_khz, double bucket_ms)
+{
+  std::vector<timeline_point> curve;
+  uint64_t first = ring.head > timeline_capacity ? ring.head - timeline_capacity : 0;
+
+  if (ring.head - first < 2)
+    return curve;
+
+  auto sample = [&ring] (uint64_t i) -> timeline_sample const & {
+    return ring.samples[i & (timeline_capacity - 1)];
+  };
+
+  uint64_t tsc0 = sample(first).tsc;
+  std::vector<double> reps, time;
+
+  for (uint64_t i = first + 1; i < ring.head; i++) {
+    timeline_sample const &prev = sample(i - 1);
+    timeline_sample const &cur = sample(i);
+
+    double end_ms = double(cur.tsc - tsc0) / tsc_khz;
+    size_t bucket = static_cast<size_t>(std::floor(end_ms / bucket_ms));
+
+    if (bucket >= reps.size()) {
+      reps.resize(bucket + 1);
+      time.resize(bucket + 1);
+    }
+
+    reps[bucket] += double(cur.count - prev.count);
+    time[bucket] += double(cur.tsc - prev.tsc) / tsc_khz;
+  }
+
+  for (size_t i = 0; i < reps.size(); i++)
+    curve.push_back({ i * bucket_ms, time[i] > 0 ? reps[i] / time[i] : 0 });
+
+  return curve;
+}
@@ -2,29 +2,190 @@
 
 #include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
+#include <functional>
 #include <thread>
 #include <array>
 #include <utility>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
 
 #include <errno.h>
+#include <linux/kvm_para.h>
 #include <signal.h>
 #include <time.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
+#include "host_info.hpp"
 #include "kvm.hpp"
+#include "metrics.hpp"
+#include "native.hpp"
+#include "options.hpp"
+#include "pipeline.hpp"
+#include "result_log.hpp"
+#include "stats.hpp"
+#include "timeline.hpp"
 
 /* This code is mapped into the guest at GPA 0. */
 static unsigned char guest_code[] alignas(4096) {
 #include "guest.inc"
                                };
 
+/* The signal that ends a time slice and the signal that only kicks the vCPU out of KVM_RUN. */
+static const int timer_signal = SIGUSR1;
+static const int kick_signal = SIGUSR2;
+
 static const uint64_t page_size = 4096;
 
+static const uint32_t msr_apic_base = 0x1b;
+static const uint64_t apic_default_base = 0xfee00000;
+static const uint64_t apic_base_bsp = 1 << 8;
+static const uint64_t apic_base_x2apic = 1 << 10;
+static const uint64_t apic_base_enable = 1 << 11;
+
+static const uint64_t cr4_pcide = 1 << 17;
+
+static const uint32_t msr_test_ctrl = 0x33;
+static const uint64_t test_ctrl_split_lock_detect = 1 << 29;
+static const uint32_t msr_core_capabilities = 0xcf;
+static const uint64_t core_caps_split_lock_detect = 1 << 5;
+static const uint64_t cr3_noflush = 1ULL << 63;
+
+/* Guest workloads. The order must match the entry table at the start of guest.asm. */
+enum class guest_entry : unsigned {
+  slack_off,
+  slack_off_timeline,
+  vector_loop,
+  alu_loop,
+  ticket_lock_loop,
+  tas_lock_loop,
+  pv_lock_loop,
+  ipi_sender,
+  ipi_receiver,
+  tlb_shootdown,
+  tlb_receiver,
+  page_fault_loop,
+  cr3_switch_loop,
+  msr_loop,
+  tsc_loop,
+  kvmclock_loop,
+  steal_loop,
+};
+
+/* Properties of each guest workload, indexed by guest_entry. */
+struct guest_workload {
+  char const *name;
+  __u64 kvm_regs::*iterations;    /* Register that holds the iteration count */
+  bool native;                    /* Can also run on the host via native_runner */
+};
+
+static guest_workload const guest_workloads[] {
+  { "slack_off",          &kvm_regs::rax, true },
+  { "slack_off_timeline", &kvm_regs::r15, true },
+  { "vector_loop",        &kvm_regs::rax, true },
+  { "alu_loop",           &kvm_regs::rax, true },
+  { "ticket_lock_loop",   &kvm_regs::rax, true },
+  { "tas_lock_loop",      &kvm_regs::rax, true },
+  { "pv_lock_loop",       &kvm_regs::r15, false },
+  { "ipi_sender",         &kvm_regs::r15, false },
+  { "ipi_receiver",       &kvm_regs::r15, false },
+  { "tlb_shootdown",      &kvm_regs::r15, false },
+  { "tlb_receiver",       &kvm_regs::r15, false },
+  { "page_fault_loop",    &kvm_regs::r15, false },
+  { "cr3_switch_loop",    &kvm_regs::r15, false },
+  { "msr_loop",           &kvm_regs::r15, false },
+  { "tsc_loop",           &kvm_regs::r15, false },
+  { "kvmclock_loop",      &kvm_regs::r15, false },
+  { "steal_loop",         &kvm_regs::r15, false },
+};
+
+static const unsigned guest_workload_count = sizeof(guest_workloads) / sizeof(guest_workloads[0]);
+
+static guest_workload const &workload(guest_entry entry)
+{
+  return guest_workloads[static_cast<unsigned>(entry)];
+}
+
+static guest_entry parse_guest_entry(std::string const &name)
+{
+  for (unsigned i = 0; i < guest_workload_count; i++)
+    if (name == guest_workloads[i].name)
+      return static_cast<guest_entry>(i);
+
+  fprintf(stderr, "unknown guest workload '%s'\n", name.c_str());
+  exit(EXIT_FAILURE);
+}
+
+/* Returns the guest address where the given workload starts executing. */
+static uint64_t guest_entry_address(guest_entry entry)
+{
+  uint64_t address;
+
+  memcpy(&address, guest_code + static_cast<unsigned>(entry) * sizeof(address), sizeof(address));
+  return address;
+}
+
+/*
+ * Interrupt and exception handlers in guest.asm. The order must match the
+ * handler table, which follows the entry table.
+ */
+enum class guest_handler : unsigned {
+  ipi,
+  tlb_flush,
+  page_fault,
+  alignment_check,
+  debug,
+};
+
+/* The vector of each handler, indexed by guest_handler. */
+static uint8_t const guest_handler_vectors[] {
+  0x40,   /* IPI_VECTOR */
+  0x41,   /* TLB_VECTOR */
+  14,     /* #PF */
+  17,     /* #AC */
+  1,      /* #DB */
+};
+
+static const unsigned guest_handler_count = sizeof(guest_handler_vectors);
+
+/* Exceptions without a handler go to a stub that reports them at this I/O port. */
+static const unsigned guest_exception_vectors = 32;
+static const uint64_t guest_exception_stub_size = 16;
+static const uint16_t guest_exception_port = 0xe0;
+
+/* Workloads that need the host's attention between steps write to this I/O port. */
+static const uint16_t guest_notify_port = 0xe1;
+
+static uint64_t guest_handler_address(guest_handler handler)
+{
+  uint64_t address;
+
+  memcpy(&address, guest_code + (guest_workload_count + static_cast<unsigned>(handler)) * sizeof(address),
+         sizeof(address));
+  return address;
+}
+
+static uint64_t guest_exception_stub(unsigned vector)
+{
+  uint64_t stubs;
+
+  memcpy(&stubs, guest_code + (guest_workload_count + guest_handler_count) * sizeof(stubs), sizeof(stubs));
+  return stubs + vector * guest_exception_stub_size;
+}
+
 /*
  * Create a memory region for KVM that contains a set of page tables. These page
  * tables establish a 1 GB identity mapping at guest-virtual address 0.
@@ -45,10 +206,53 @@ class page_table {
    */
   uint64_t *pml4() { return tables_; }
   uint64_t *pdpt() { return tables_ + 1 * page_size/sizeof(uint64_t); }
+  uint64_t *pd()   { return tables_ + 2 * page_size/sizeof(uint64_t); }
+  uint64_t *pt()   { return tables_ + 3 * page_size/sizeof(uint64_t); }
 
 public:
 
+  static const uint64_t small_pages_end = 2 << 20;
+
+  /*
+   * Map the first 2 MiB with 4K pages and the rest of the low GB with 2 MiB
+   * pages, so the guest can remap single pages by writing to pte_gpa(). The
+   * mapping stays 1:1 until it does. Must be called before any vCPU runs.
+   */
+  void map_small_pages()
+  {
+    pdpt()[0] = (gpa_ + 2 * page_size) | page_pws;
+    pd()[0] = (gpa_ + 3 * page_size) | page_pws;
+
+    for (uint64_t i = 1; i < 512; i++)
+      pd()[i] = (i * small_pages_end) | page_pws | page_large;
+    for (uint64_t i = 0; i < 512; i++)
+      pt()[i] = pte(i * page_size);
+  }
+
+  /*
+   * Map the 2 MiB at va with the page table at pt_gpa instead, which the
+   * caller fills. Only after map_small_pages().
+   */
+  void map_page_table(uint64_t va, uint64_t pt_gpa)
+  {
+    die_on(va % small_pages_end != 0 or va == 0 or va >= (1 << 30), "invalid page table address");
+    pd()[va / small_pages_end] = pt_gpa | page_pws;
+  }
+
+  /* The GPA of the PTE that maps a page below small_pages_end. */
+  uint64_t pte_gpa(uint64_t va) const
+  {
+    die_on(va >= small_pages_end, "address not mapped by 4K pages");
+    return gpa_ + 3 * page_size + (va / page_size) * sizeof(uint64_t);
+  }
+
+  uint64_t gpa() const { return gpa_; }
+
+  /* A PTE that maps the given frame. */
+  uint64_t pte(uint64_t frame) const { return frame | page_pws; }
+
   page_table(kvm *kvm, uint64_t gpa)
+    : gpa_(gpa)
   {
     die_on(gpa % page_size != 0, "Page table GPA not aligned");
 
@@ -73,31 +277,347 @@ public:
   }
 };
 
-class timeout_vm {
-  /* Page tables are located after guest code. */
-  uint64_t const page_table_base = sizeof(guest_code);
+/*
+ * A GDT with the flat 64-bit code and data segments that the vCPUs use, and an
+ * IDT with interrupt gates for the guest's interrupt handlers. Both live in one
+ * memory region, the GDT in the first page and the IDT in the second.
+ */
+class descriptor_tables {
+  static const uint16_t code_selector = 0x8;
+
+  const size_t tables_size_ = 2 * page_size;
+  uint64_t gpa_;
+  uint64_t *tables_;
+
+  uint64_t *gdt() { return tables_; }
+  uint64_t *idt() { return tables_ + page_size/sizeof(uint64_t); }
+
+public:
+
+  static const uint16_t gdt_limit = 3 * 8 - 1;
+  static const uint16_t idt_limit = 256 * 16 - 1;
+
+  uint64_t gdt_gpa() const { return gpa_; }
+  uint64_t idt_gpa() const { return gpa_ + page_size; }
+
+  /* Install an interrupt gate for a handler running on the code segment. */
+  void set_gate(uint8_t vector, uint64_t handler)
+  {
+    uint64_t *gate = idt() + 2 * vector;
+
+    gate[0] = (handler & 0xffff) | uint64_t(code_selector) << 16 |
+              uint64_t(0x8e) << 40 |                  /* present, DPL 0, 64-bit interrupt gate */
+              ((handler >> 16) & 0xffff) << 48;
+    gate[1] = handler >> 32;
+  }
+
+  descriptor_tables(kvm *kvm, uint64_t gpa)
+    : gpa_(gpa)
+  {
+    die_on(gpa % page_size != 0, "Descriptor table GPA not aligned");
+
+    tables_ = static_cast<uint64_t *>(aligned_alloc(page_size, tables_size_));
+    die_on(tables_ == nullptr, "aligned_alloc");
+    memset(tables_, 0, tables_size_);
+
+    /* Must match the segment state that timeout_vcpu sets up */
+    gdt()[1] = 0x00af9b000000ffffULL;     /* 0x08: 64-bit code */
+    gdt()[2] = 0x00cf93000000ffffULL;     /* 0x10: data */
+
+    kvm->add_memory_region(gpa, tables_size_, tables_);
+  }
+
+  descriptor_tables(descriptor_tables const &) = delete;
+
+  ~descriptor_tables()
+  {
+    free(tables_);
+  }
+};
+
+/*
+ * Anonymous host memory that is mapped into the guest at a fixed GPA. The host
+ * uses it to pass data to the guest and to collect results from it.
+ */
+class guest_memory {
+  uint64_t gpa_;
+  size_t size_;
+  void *backing_;
+
+public:
+
+  uint64_t gpa() const { return gpa_; }
+
+  template <typename T>
+  T *at(uint64_t offset = 0)
+  {
+    return reinterpret_cast<T *>(static_cast<char *>(backing_) + offset);
+  }
+
+  guest_memory(kvm *kvm, uint64_t gpa, size_t size)
+    : gpa_(gpa), size_(size)
+  {
+    die_on(gpa % page_size != 0 or size % page_size != 0, "Guest memory not aligned");
+
+    backing_ = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    die_on(backing_ == MAP_FAILED, "mmap");
+
+    kvm->add_memory_region(gpa, size, backing_);
+  }
+
+  /* Give the backing memory back to the host. The guest then reads zeroes and KVM has to fault it in again. */
+  void discard()
+  {
+    die_on(madvise(backing_, size_, MADV_DONTNEED) < 0, "madvise");
+  }
+
+  guest_memory(guest_memory const &) = delete;
+
+  ~guest_memory()
+  {
+    die_on(munmap(backing_, size_) < 0, "munmap");
+  }
+};
+
+/* Optional VM features, see guest_vm::enable_features(). */
+enum vm_feature : unsigned {
+  vm_bus_lock_exit       = 1 << 0,    /* Exit to userspace after each bus lock in the guest */
+  vm_disable_pause_exits = 1 << 1,    /* No PAUSE-loop exiting, spinning vCPUs keep their CPU */
+  vm_irqchip             = 1 << 2,    /* In-kernel local APICs, needed for HLT and PV kicks */
+  vm_x2apic              = 1 << 3,    /* vm_irqchip with the local APICs in x2APIC mode */
+  vm_pcid                = 1 << 4,    /* PCID and INVPCID in CPUID, CR4.PCIDE set */
+  vm_split_lock_detect   = 1 << 5,    /* Core capabilities in CPUID, for split lock detection */
+  vm_user_space_msr      = 1 << 6,    /* MSR accesses denied by the filter exit to userspace */
+  vm_page_faults         = 1 << 7,    /* #PF maps page_fault_loop's pages, see struct fault_shared */
+};
+
+/* An MSR that userspace emulates. Handlers return false to inject #GP. */
+struct user_msr {
+  std::function<bool(uint64_t &)> read;
+  std::function<bool(uint64_t)> write;
+};
+
+/*
+ * The MSRs that userspace emulates, a contiguous range starting at base, so
+ * looking up the handler on an exit is just an index into a flat table.
+ */
+class user_msr_table {
+  uint32_t base_ = 0;
+  std::vector<user_msr> msrs_;
+  std::vector<uint8_t> bitmap_;
+
+public:
+
+  user_msr_table() = default;
+
+  /*
+   * KVM copies the bitmap in whole longs, so it is padded to a multiple of
+   * sizeof(unsigned long) with allow bits.
+   */
+  user_msr_table(uint32_t base, std::vector<user_msr> msrs)
+    : base_(base), msrs_(std::move(msrs)),
+      bitmap_((msrs_.size() + 8 * sizeof(unsigned long) - 1) / (8 * sizeof(unsigned long)) * sizeof(unsigned long),
+              0xff)
+  {
+    for (size_t i = 0; i < msrs_.size(); i++)
+      if (msrs_[i].read or msrs_[i].write)
+        bitmap_[i / 8] &= ~(1 << (i % 8));
+  }
+
+  user_msr const *find(uint32_t index) const
+  {
+    uint32_t offset = index - base_;    /* Wraps around below base */
+
+    return offset < msrs_.size() ? &msrs_[offset] : nullptr;
+  }
+
+  /* A filter that denies all accesses to MSRs with handlers, so they exit to userspace. */
+  kvm_msr_filter filter()
+  {
+    kvm_msr_filter filter {};
+
+    filter.flags = KVM_MSR_FILTER_DEFAULT_ALLOW;
+    filter.ranges[0].flags = KVM_MSR_FILTER_READ | KVM_MSR_FILTER_WRITE;
+    filter.ranges[0].nmsrs = msrs_.size();
+    filter.ranges[0].base = base_;
+    filter.ranges[0].bitmap = bitmap_.data();
+
+    return filter;
+  }
+};
+
+/*
+ * A VM with the guest code, page tables and memory shared with the host. It
+ * doesn't have any vCPUs on its own, see timeout_vcpu.
+ */
+class guest_vm {
+  /* Page tables and descriptor tables are located after guest code. */
+  static const uint64_t page_table_base = sizeof(guest_code);
+  static const uint64_t descriptor_table_base = page_table_base + 4 * page_size;
+
+  /* Memory shared between host and guest starts at 1 MiB. */
+  static const uint64_t shared_base = 1 << 20;
+  static const uint64_t shared_size = 2 << 20;
 
+  /* Followed by a small stack for every vCPU. */
+  static const uint64_t stack_base = shared_base + shared_size;
+  static const uint64_t stack_size = page_size;
+
+  unsigned const features_;
   kvm kvm_;
-  kvm_vcpu vcpu_ { kvm_.create_vcpu(0) };
+  bool features_enabled_ { enable_features() };
   page_table page_table_ { &kvm_, page_table_base };
+  descriptor_tables descriptor_tables_ { &kvm_, descriptor_table_base };
+  guest_memory shared_ { &kvm_, shared_base, shared_size };
+  guest_memory stacks_ { &kvm_, stack_base, max_vcpus * stack_size };
+  std::vector<kvm_cpuid_entry2> cpuid_;
+  user_msr_table user_msrs_;
+
+  /* VM-wide capabilities have to be enabled before any vCPU is created. */
+  bool enable_features()
+  {
+    if (features_ & vm_bus_lock_exit) {
+      die_on(not (kvm_.check_extension(KVM_CAP_X86_BUS_LOCK_EXIT) & KVM_BUS_LOCK_DETECTION_EXIT),
+             "bus lock exits not supported");
+      kvm_.enable_cap(KVM_CAP_X86_BUS_LOCK_EXIT, KVM_BUS_LOCK_DETECTION_EXIT);
+    }
+
+    if (features_ & vm_disable_pause_exits) {
+      die_on(not (kvm_.check_extension(KVM_CAP_X86_DISABLE_EXITS) & KVM_X86_DISABLE_EXITS_PAUSE),
+             "disabling PAUSE exits not supported");
+      kvm_.enable_cap(KVM_CAP_X86_DISABLE_EXITS, KVM_X86_DISABLE_EXITS_PAUSE);
+    }
+
+    if (features_ & (vm_irqchip | vm_x2apic))
+      kvm_.create_irqchip();
+
+    if (features_ & vm_user_space_msr) {
+      die_on(not (kvm_.check_extension(KVM_CAP_X86_USER_SPACE_MSR) & KVM_MSR_EXIT_REASON_FILTER) or
+             not kvm_.check_extension(KVM_CAP_X86_MSR_FILTER), "userspace MSR exits not supported");
+      kvm_.enable_cap(KVM_CAP_X86_USER_SPACE_MSR, KVM_MSR_EXIT_REASON_FILTER);
+    }
+
+    return true;
+  }
+
+  /* Offer what KVM supports to the guest, but only the given paravirtual features. */
+  void setup_cpuid(uint32_t pv_features)
+  {
+    bool found = false;
+
+    cpuid_ = kvm_.get_supported_cpuid();
+
+    for (auto &leaf : cpuid_)
+      if (leaf.function == KVM_CPUID_FEATURES) {
+        die_on((leaf.eax & pv_features) != pv_features, "paravirtual features not supported");
+        leaf.eax = pv_features;
+        found = true;
+      }
+
+    die_on(not found, "no paravirtual CPUID leaf");
+  }
+
+public:
+
+  static const unsigned max_vcpus = 64;
+
+  kvm &get_kvm() { return kvm_; }
+
+  unsigned features() const { return features_; }
+
+  descriptor_tables const &tables() const { return descriptor_tables_; }
+
+  /* Initial stack pointer of a vCPU. */
+  uint64_t stack_top(unsigned vcpu) const
+  {
+    die_on(vcpu >= max_vcpus, "no stack for vCPU");
+    return stack_base + (vcpu + 1) * stack_size;
+  }
+
+  /* CPUID for all vCPUs. If it's empty, vCPUs keep KVM's default. */
+  std::vector<kvm_cpuid_entry2> const &cpuid() const { return cpuid_; }
+
+  uint64_t page_table_gpa() const { return page_table_base; }
+
+  /* Emulate the given MSRs from base on in userspace. Needs vm_user_space_msr. */
+  void emulate_msrs(uint32_t base, std::vector<user_msr> msrs)
+  {
+    die_on(not (features_ & vm_user_space_msr), "userspace MSRs need vm_user_space_msr");
+
+    user_msrs_ = user_msr_table { base, std::move(msrs) };
+    kvm_.set_msr_filter(user_msrs_.filter());
+  }
+
+  user_msr_table const &user_msrs() const { return user_msrs_; }
+  page_table &page_tables() { return page_table_; }
+
+  /*
+   * Memory that the guest sees at shared_gpa(). It is large enough to hold any
+   * of the structures that guest workloads exchange with the host.
+   */
+  template <typename T>
+  T *shared()
+  {
+    static_assert(sizeof(T) <= shared_size, "Shared structure too large");
+    return shared_.at<T>();
+  }
+
+  uint64_t shared_gpa() const { return shared_.gpa(); }
+
+  /* pv_features is a mask of KVM_FEATURE_* bits the guest sees in CPUID. */
+  explicit guest_vm(unsigned features = 0, uint32_t pv_features = 0)
+    : features_(features)
+  {
+    static_assert(sizeof(guest_code) + 6 * page_size <= shared_base, "Guest code overlaps shared memory");
+
+    kvm_.add_memory_region(0, sizeof(guest_code), guest_code);
+
+    for (unsigned v = 0; v < guest_exception_vectors; v++)
+      descriptor_tables_.set_gate(v, guest_exception_stub(v));
+    for (unsigned i = 0; i < guest_handler_count; i++)
+      if (static_cast<guest_handler>(i) != guest_handler::page_fault or (features_ & vm_page_faults))
+        descriptor_tables_.set_gate(guest_handler_vectors[i], guest_handler_address(static_cast<guest_handler>(i)));
+
+    // The guest needs CPUID to know about these features.
+    if (pv_features or (features_ & (vm_x2apic | vm_pcid | vm_split_lock_detect)))
+      setup_cpuid(pv_features);
+  }
+};
+
+/*
+ * A vCPU of a guest_vm with its own timer. It must be created on the thread
+ * that runs it, because the timer signal is directed at this thread.
+ */
+class timeout_vcpu {
+  kvm &kvm_;
+  kvm_vcpu vcpu_;
+  uint64_t stack_top_;
+  user_msr_table const &user_msrs_;
 
   timer_t timer;
+  uint64_t exits_ = 0;
+  uint64_t bus_lock_exits_ = 0;
+  uint64_t user_msr_exits_ = 0;
+  vcpu_metrics *metrics_ = nullptr;
 
   /*
    * Set up the control and segment register state to enter 64-bit mode
    * directly.
    */
-  void enable_long_mode()
+  void enable_long_mode(guest_vm const &vm)
   {
     auto sregs = vcpu_.get_sregs();
 
     /* Set up 64-bit long mode */
     sregs.cr0  = 0x80010013U;
     sregs.cr2  = 0;
-    sregs.cr3  = page_table_base;
-    sregs.cr4  = 0x00000020U;
+    sregs.cr3  = vm.page_table_gpa();
+    sregs.cr4  = 0x00000620U; /* PAE, OSFXSR, OSXMMEXCPT */
     sregs.efer = 0x00000500U;
 
+    if (vm.features() & vm_pcid)
+      sregs.cr4 |= cr4_pcide;
+
     /* 64-bit code segment */
     sregs.cs.base = 0;
     sregs.cs.selector = 0x8;
@@ -114,121 +634,2591 @@ class timeout_vm {
 
     sregs.ss = sregs.es = sregs.fs = sregs.gs = sregs.ds;
 
+    /* Descriptor tables for interrupt delivery */
+    sregs.gdt.base = vm.tables().gdt_gpa();
+    sregs.gdt.limit = descriptor_tables::gdt_limit;
+    sregs.idt.base = vm.tables().idt_gpa();
+    sregs.idt.limit = descriptor_tables::idt_limit;
+
     vcpu_.set_sregs(sregs);
   }
 
 public:
 
-  /*
-   * Runs the VM and returns how many loops the guest code executed.
-   */
-  uint64_t run()
-  {
-    auto state = vcpu_.get_state();
+  uint32_t tsc_khz() { return vcpu_.get_tsc_khz(); }
 
-    kvm_regs regs {};
+  /* Run the guest TSC at this frequency. Returns false if KVM can't scale the TSC to it. */
+  bool set_tsc_khz(uint32_t khz) { return vcpu_.set_tsc_khz(khz); }
 
-    regs.rflags = 2; /* reserved bit */
-    regs.rax = 0;
-    regs.rip = 0;
+  /* Let KVM publish kvmclock in the pvclock_vcpu_time_info at gpa. */
+  void enable_kvmclock(uint64_t gpa)
+  {
+    die_on(gpa % 32 != 0, "kvmclock not aligned");
+    vcpu_.set_msr(MSR_KVM_SYSTEM_TIME_NEW, gpa | KVM_MSR_ENABLED);
+  }
 
-    vcpu_.set_regs(regs);
-    vcpu_.run();
+  /* Whether KVM lets the guest enable split lock detection in MSR_TEST_CTRL. */
+  bool split_lock_detect_supported()
+  {
+    uint64_t caps;
 
-    regs = vcpu_.get_regs();
+    return vcpu_.try_get_msr(msr_core_capabilities, caps) and (caps & core_caps_split_lock_detect);
+  }
 
-    die_on(state->exit_reason != KVM_EXIT_INTR, "unexpected exit");
+  /* Turn split lock detection in the guest on or off, as if the guest wrote MSR_TEST_CTRL. */
+  void set_split_lock_detect(bool on)
+  {
+    vcpu_.set_msr(msr_test_ctrl, on ? test_ctrl_split_lock_detect : 0);
+  }
 
-    return regs.rax;
+  /* Let KVM report steal time and preemption in the kvm_steal_time at gpa. */
+  void enable_steal_time(uint64_t gpa)
+  {
+    die_on(gpa % 64 != 0, "steal time not aligned");
+    vcpu_.set_msr(MSR_KVM_STEAL_TIME, gpa | KVM_MSR_ENABLED);
   }
 
-  void clear_pending_timer_event()
+  /*
+   * Ask KVM to store the general purpose registers in kvm_run on every exit,
+   * which saves a KVM_GET_REGS call. Returns false if KVM can't do this.
+   */
+  bool enable_sync_regs()
   {
-    sigset_t sigset;
-    sigemptyset(&sigset);
-    sigaddset(&sigset, SIGUSR1);
+    if (not (kvm_.check_extension(KVM_CAP_SYNC_REGS) & KVM_SYNC_X86_REGS))
+      return false;
 
-    struct timespec timeout = {
-      .tv_sec = 0,
-      .tv_nsec = 0,
-    };
+    vcpu_.get_state()->kvm_valid_regs = KVM_SYNC_X86_REGS;
+    return true;
+  }
 
-    int rc = sigtimedwait(&sigset, nullptr, &timeout);
-    die_on(rc < 0 && errno != EAGAIN, "failed to clear timer");
+  /* Register state after the last exit. Only valid after enable_sync_regs(). */
+  kvm_regs const &synced_regs() { return vcpu_.get_state()->s.regs.regs; }
+
+  kvm_regs get_regs() { return vcpu_.get_regs(); }
+
+  /* Everything the guest workloads use, to switch between guest contexts. */
+  struct context_state {
+    kvm_regs regs;
+    kvm_sregs sregs;
+    kvm_fpu fpu;
+  };
+
+  context_state save_state() { return { vcpu_.get_regs(), vcpu_.get_sregs(), vcpu_.get_fpu() }; }
+
+  void restore_state(context_state const &state)
+  {
+    vcpu_.set_regs(state.regs);
+    vcpu_.set_sregs(state.sregs);
+    vcpu_.set_fpu(state.fpu);
   }
 
+  /* Number of returns from KVM_RUN so far and the reason of the last one. */
+  uint64_t exits() const { return exits_; }
+  uint64_t bus_lock_exits() const { return bus_lock_exits_; }
+  uint64_t user_msr_exits() const { return user_msr_exits_; }
+  uint32_t last_exit_reason() { return vcpu_.get_state()->exit_reason; }
+
+  /* Count every exit in these live metrics as well. */
+  void set_metrics(vcpu_metrics *metrics) { metrics_ = metrics; }
+
   /*
-   * Program a relative timeout.
-   *
-   * This timeout starts running now. When it expires, KVM_RUN will return EINTR with exit reason KVM_EXIT_INTR.
+   * Point the vCPU at the given guest workload. Workload parameters are passed
+   * in the general purpose registers of args.
    */
-  template <typename REP, typename PERIOD>
-  void arm_timer(std::chrono::duration<REP, PERIOD> rel_timeout)
+  void start(guest_entry entry, kvm_regs args)
   {
-    // SIGUSR1 stays pending until we clear it. If we don't, the next KVM_RUN will immediately exit with EINTR.
-    clear_pending_timer_event();
+    args.rflags = 2; /* reserved bit */
+    args.rip = guest_entry_address(entry);
+    args.rsp = stack_top_;
 
-    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(rel_timeout);
-
-    struct itimerspec tspec = {
-      .it_interval = {},
-      .it_value = {
-        .tv_sec = static_cast<time_t>(ns.count() / 1000000000L),
-        .tv_nsec = static_cast<long>(ns.count() % 1000000000L),
-      },
-    };
-
-    die_on(timer_settime(timer, 0 /* relative timeout */, &tspec, nullptr) != 0, "failed to set timer");
+    vcpu_.set_regs(args);
   }
 
-  timeout_vm()
+  /* Bits returned by resume() */
+  enum : unsigned {
+    timer_expired = 1 << 0,
+    kicked        = 1 << 1,
+    notified      = 1 << 2,   /* The guest wrote to guest_notify_port */
+  };
+
+  /*
+   * Continue executing the guest until a signal interrupts it or the guest
+   * notifies us. Returns which of our signals were pending.
+   */
+  unsigned resume()
   {
-    kvm_.add_memory_region(0, sizeof(guest_code), guest_code);
+    for (;;) {
+      vcpu_.run();
+      exits_++;
 
-    enable_long_mode();
+      uint32_t reason = vcpu_.get_state()->exit_reason;
 
+      if (metrics_)
+        metrics_->count_exit(reason);
 
-    // Create timer that fires SIGUSR1 when it expires.
-    struct sigevent sevp {};
+      if (reason == KVM_EXIT_X86_RDMSR or reason == KVM_EXIT_X86_WRMSR) {
+        handle_user_msr(reason == KVM_EXIT_X86_WRMSR);
+        user_msr_exits_++;
+        continue;
+      }
 
-    sevp.sigev_notify = SIGEV_THREAD_ID;
+      if (reason != KVM_EXIT_X86_BUS_LOCK)
+        break;
 
-    // Make sure we get timers on this thread.
-    sevp._sigev_un._tid = gettid();
+      // Bus lock exits happen after the instruction, so we can just continue.
+      bus_lock_exits_++;
+    }
 
-    sevp.sigev_signo = SIGUSR1;
+    kvm_run const *state = vcpu_.get_state();
 
-    die_on(timer_create(CLOCK_MONOTONIC, &sevp, &timer) != 0, "failed to create timer");
+    if (state->exit_reason == KVM_EXIT_IO and state->io.port == guest_exception_port)
+      report_guest_exception();
 
-    // Block SIGUSR1 from actually being delivered to this thread.
-    sigset_t sigset;
-    sigemptyset(&sigset);
-    sigaddset(&sigset, SIGUSR1);
+    if (state->exit_reason == KVM_EXIT_IO and state->io.port == guest_notify_port)
+      return consume_pending_signals() | notified;
 
-    sigset_t sigset_old;
-    die_on(pthread_sigmask(SIG_BLOCK, &sigset, &sigset_old) != 0, "failed to block signal");
+    die_on(state->exit_reason != KVM_EXIT_INTR, "unexpected exit");
 
-    // KVM allows us to atomically swap the signal mask. We set the original signal mask here, which allows SIGUSR1 to
-    // interrupt KVM_RUN.
-    vcpu_.set_signal_mask(sigset_old);
+    return consume_pending_signals();
   }
-};
 
-int main()
-{
-  timeout_vm vm;
+  /* KVM completes the guest's RDMSR or WRMSR with our result on the next KVM_RUN. */
+  void handle_user_msr(bool write)
+  {
+    auto &msr = vcpu_.get_state()->msr;
+    user_msr const *handler = user_msrs_.find(msr.index);
+    uint64_t data = msr.data;
+    bool ok;
 
-  for (int timeout = 1; timeout < 50; timeout++) {
-    vm.arm_timer(std::chrono::milliseconds{timeout});
+    if (write)
+      ok = handler and handler->write and handler->write(data);
+    else
+      ok = handler and handler->read and handler->read(data);
 
-    auto time_before = std::chrono::steady_clock::now();
-    uint64_t reps = vm.run();
+    msr.data = data;
+    msr.error = not ok;
+  }
+
+  /* An exception stub in the guest stopped the vCPU. See exception_stubs in guest.asm. */
+  [[noreturn]] void report_guest_exception()
+  {
+    kvm_regs regs = vcpu_.get_regs();
+
+    fprintf(stderr, "guest exception %llu at RIP %#llx, error code %#llx, CR2 %#llx\n", regs.rax, regs.rbx,
+            regs.rdx, regs.rcx);
+    exit(EXIT_FAILURE);
+  }
+
+  /*
+   * Runs the given guest workload until the timer expires and returns the final
+   * register state.
+   */
+  kvm_regs run(guest_entry entry, kvm_regs args)
+  {
+    start(entry, args);
+    return resume_until_timer();
+  }
+
+  /* Continues the started workload until the timer expires and returns the register state. */
+  kvm_regs resume_until_timer()
+  {
+    while (not (resume() & timer_expired))
+      ;
+
+    return vcpu_.get_regs();
+  }
+
+  /*
+   * Runs the VM and returns how many loops the guest code executed.
+   */
+  uint64_t run()
+  {
+    return run(guest_entry::slack_off, {}).rax;
+  }
+
+  /* Dequeue pending timer and kick signals and report which ones there were. */
+  unsigned consume_pending_signals()
+  {
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, timer_signal);
+    sigaddset(&sigset, kick_signal);
+
+    struct timespec timeout = {
+      .tv_sec = 0,
+      .tv_nsec = 0,
+    };
+
+    unsigned pending = 0;
+    int rc;
+
+    while ((rc = sigtimedwait(&sigset, nullptr, &timeout)) > 0)
+      pending |= rc == timer_signal ? timer_expired : kicked;
+
+    die_on(rc < 0 && errno != EAGAIN, "failed to consume signals");
+    return pending;
+  }
+
+  void clear_pending_timer_event()
+  {
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, timer_signal);
+
+    struct timespec timeout = {
+      .tv_sec = 0,
+      .tv_nsec = 0,
+    };
+
+    int rc = sigtimedwait(&sigset, nullptr, &timeout);
+    die_on(rc < 0 && errno != EAGAIN, "failed to clear timer");
+  }
+
+  /*
+   * Program a relative timeout.
+   *
+   * This timeout starts running now. When it expires, KVM_RUN will return EINTR with exit reason KVM_EXIT_INTR.
+   */
+  template <typename REP, typename PERIOD>
+  void arm_timer(std::chrono::duration<REP, PERIOD> rel_timeout)
+  {
+    // SIGUSR1 stays pending until we clear it. If we don't, the next KVM_RUN will immediately exit with EINTR.
+    clear_pending_timer_event();
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(rel_timeout);
+
+    struct itimerspec tspec = {
+      .it_interval = {},
+      .it_value = {
+        .tv_sec = static_cast<time_t>(ns.count() / 1000000000L),
+        .tv_nsec = static_cast<long>(ns.count() % 1000000000L),
+      },
+    };
+
+    die_on(timer_settime(timer, 0 /* relative timeout */, &tspec, nullptr) != 0, "failed to set timer");
+  }
+
+  /*
+   * Program an absolute deadline, so several vCPU threads can stop at the same
+   * time. steady_clock is CLOCK_MONOTONIC, just like our timer.
+   */
+  void arm_timer_at(std::chrono::steady_clock::time_point deadline)
+  {
+    clear_pending_timer_event();
+
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch());
+
+    struct itimerspec tspec = {
+      .it_interval = {},
+      .it_value = {
+        .tv_sec = static_cast<time_t>(ns.count() / 1000000000L),
+        .tv_nsec = static_cast<long>(ns.count() % 1000000000L),
+      },
+    };
+
+    die_on(timer_settime(timer, TIMER_ABSTIME, &tspec, nullptr) != 0, "failed to set timer");
+  }
+
+  timeout_vcpu(guest_vm &vm, int id)
+    : kvm_(vm.get_kvm()), vcpu_(kvm_.create_vcpu(id)), stack_top_(vm.stack_top(id)), user_msrs_(vm.user_msrs())
+  {
+    // CPUID comes first, because KVM checks register state against it.
+    if (not vm.cpuid().empty())
+      vcpu_.set_cpuid(vm.cpuid());
+
+    enable_long_mode(vm);
+
+    // With in-kernel APICs, all vCPUs except the first wait for a startup IPI.
+    if (vm.features() & (vm_irqchip | vm_x2apic))
+      vcpu_.set_mp_state(KVM_MP_STATE_RUNNABLE);
+
+    if (vm.features() & vm_x2apic)
+      vcpu_.set_msr(msr_apic_base, apic_default_base | apic_base_enable | apic_base_x2apic |
+                                   (id == 0 ? apic_base_bsp : 0));
+
+    // Create timer that fires timer_signal when it expires.
+    struct sigevent sevp {};
+
+    sevp.sigev_notify = SIGEV_THREAD_ID;
+
+    // Make sure we get timers on this thread.
+    sevp._sigev_un._tid = gettid();
+
+    sevp.sigev_signo = timer_signal;
+
+    die_on(timer_create(CLOCK_MONOTONIC, &sevp, &timer) != 0, "failed to create timer");
+
+    // Block our signals from actually being delivered to this thread.
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, timer_signal);
+    sigaddset(&sigset, kick_signal);
+
+    sigset_t sigset_old;
+    die_on(pthread_sigmask(SIG_BLOCK, &sigset, &sigset_old) != 0, "failed to block signal");
+
+    // KVM allows us to atomically swap the signal mask. We set the original signal mask without our signals here,
+    // which allows them to interrupt KVM_RUN. They may already be blocked if this thread created a VM before.
+    sigdelset(&sigset_old, timer_signal);
+    sigdelset(&sigset_old, kick_signal);
+    vcpu_.set_signal_mask(sigset_old);
+  }
+
+  timeout_vcpu(timeout_vcpu const &) = delete;
+
+  ~timeout_vcpu()
+  {
+    die_on(timer_delete(timer) != 0, "failed to delete timer");
+  }
+};
+
+/* A VM with a single vCPU that runs on the calling thread. */
+class timeout_vm : public guest_vm, public timeout_vcpu {
+public:
+
+  explicit timeout_vm(unsigned features = 0, uint32_t pv_features = 0)
+    : guest_vm(features, pv_features), timeout_vcpu(*this, 0)
+  {}
+};
+
+/* CPU time consumed by the calling thread. */
+static std::chrono::nanoseconds thread_cpu_time()
+{
+  struct timespec ts;
+
+  die_on(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0, "clock_gettime");
+  return std::chrono::seconds { ts.tv_sec } + std::chrono::nanoseconds { ts.tv_nsec };
+}
+
+/*
+ * A reusable barrier for a fixed number of threads. The last thread to arrive
+ * runs the completion function before the others are released.
+ */
+class thread_barrier {
+  std::mutex lock_;
+  std::condition_variable released_;
+  unsigned const threads_;
+  unsigned waiting_ = 0;
+  uint64_t generation_ = 0;
+
+public:
+
+  explicit thread_barrier(unsigned threads) : threads_(threads) {}
+
+  template <typename FN>
+  void wait(FN completion)
+  {
+    std::unique_lock<std::mutex> guard { lock_ };
+    uint64_t generation = generation_;
+
+    if (++waiting_ == threads_) {
+      completion();
+      waiting_ = 0;
+      generation_++;
+      released_.notify_all();
+      return;
+    }
+
+    released_.wait(guard, [&] { return generation_ != generation; });
+  }
+};
+
+/* Restrict the calling thread to the first n host CPUs. n = 0 leaves it unrestricted. */
+static void pin_to_cpus(unsigned n)
+{
+  cpu_set_t cpus;
+
+  if (n == 0)
+    return;
+
+  die_on(n > CPU_SETSIZE, "invalid number of CPUs");
+
+  CPU_ZERO(&cpus);
+  for (unsigned cpu = 0; cpu < n; cpu++)
+    CPU_SET(cpu, &cpus);
+
+  die_on(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0, "pthread_setaffinity_np");
+}
+
+/* Scheduler statistics of the calling thread. */
+struct sched_stats {
+  std::chrono::nanoseconds run_delay;   /* Time spent runnable, but waiting for a CPU */
+  uint64_t voluntary_switches;
+  uint64_t involuntary_switches;
+
+  static sched_stats current()
+  {
+    sched_stats stats {};
+    uint64_t on_cpu_ns = 0, run_delay_ns = 0;
+    struct rusage usage;
+
+    // Without schedstat support, run_delay stays zero.
+    std::istringstream { read_first_line("/proc/thread-self/schedstat") } >> on_cpu_ns >> run_delay_ns;
+    stats.run_delay = std::chrono::nanoseconds { run_delay_ns };
+
+    die_on(getrusage(RUSAGE_THREAD, &usage) != 0, "getrusage");
+    stats.voluntary_switches = usage.ru_nvcsw;
+    stats.involuntary_switches = usage.ru_nivcsw;
+
+    return stats;
+  }
+};
+
+/*
+ * Runs one time slice of a guest workload and measures it. Without restart,
+ * the workload continues where the previous slice left it, and the reps count
+ * from when it was started.
+ */
+static slice_record run_slice(timeout_vcpu &vm, std::chrono::nanoseconds timeout,
+                              guest_entry entry = guest_entry::slack_off, kvm_regs args = {}, bool restart = true)
+{
+  vm.arm_timer(timeout);
+
+  uint64_t exits_before = vm.exits();
+  auto cpu_before = thread_cpu_time();
+  auto time_before = std::chrono::steady_clock::now();
+  kvm_regs regs = restart ? vm.run(entry, args) : vm.resume_until_timer();
+  auto time_after = std::chrono::steady_clock::now();
+  auto cpu_after = thread_cpu_time();
+
+  std::chrono::nanoseconds wall_ns = time_after - time_before;
+  slice_record record;
+
+  record[col_timeout_ns] = timeout.count();
+  record[col_reps] = regs.*workload(entry).iterations;
+  record[col_wall_ns] = wall_ns.count();
+  record[col_cpu_ns] = (cpu_after - cpu_before).count();
+  record[col_overshoot_ns] = (wall_ns - timeout).count();
+  record[col_exit_reason] = vm.last_exit_reason();
+  record[col_exits] = vm.exits() - exits_before;
+
+  return record;
+}
+
+/* Runs the sweep on one VM and hands a record for every slice to the collector. */
+static void sweep_vm(spsc_ring<slice_record> &results, vcpu_metrics &metrics, uint64_t rounds, bool bus_lock_exit)
+{
+  timeout_vm vm { bus_lock_exit ? vm_bus_lock_exit : 0u };
+
+  vm.set_metrics(&metrics);
+
+  for (uint64_t round = 0; round < rounds; round++)
+    for (int timeout = 1; timeout < 50; timeout++) {
+      slice_record record = run_slice(vm, std::chrono::milliseconds{timeout});
+
+      metrics.count_slice(record);
+      results.push(record);
+    }
+}
+
+/*
+ * The original demo: run the split lock loop for increasingly long time slices.
+ * With --vms=N, N VMs run the sweep concurrently, each on its own thread.
+ */
+static int sweep(options const &opts)
+{
+  uint64_t rounds = opts.get_u64("rounds", 1);
+  uint64_t vms = opts.get_u64("vms", 1);
+  std::unique_ptr<result_log_writer> log;
+
+  die_on(vms == 0, "need at least one VM");
+
+  if (opts.has("log"))
+    log.reset(new result_log_writer { opts.get("log", "").c_str(), host_fingerprint {}.to_string() });
+
+  sketch_set sketches;
+  result_collector collector { vms, opts.get_u64("ring-size", 1024), log.get(),
+                               opts.has("sketch") ? &sketches : nullptr, not opts.has("quiet") };
+  std::vector<std::thread> threads;
+  std::vector<std::unique_ptr<vcpu_metrics>> metrics;
+  std::vector<vcpu_metrics *> metrics_view;
+  std::unique_ptr<metrics_server> server;
+
+  for (uint64_t i = 0; i < vms; i++) {
+    metrics.emplace_back(new vcpu_metrics);
+    metrics_view.push_back(metrics.back().get());
+  }
+
+  if (opts.has("metrics-socket"))
+    server.reset(new metrics_server { opts.get("metrics-socket", ""), metrics_view });
+
+  for (uint64_t i = 0; i < vms; i++)
+    threads.emplace_back(sweep_vm, std::ref(collector.ring(i)), std::ref(*metrics[i]), rounds,
+                         opts.has("bus-lock-exit"));
+
+  for (auto &thread : threads)
+    thread.join();
+
+  uint64_t dropped = collector.finish();
+
+  if (opts.has("sketch"))
+    sketches.save(opts.get("sketch", "").c_str());
+
+  return dropped == 0 ? 0 : EXIT_FAILURE;
+}
+
+/* Throughput measured at one timeout by the adaptive sweep. */
+struct adaptive_point {
+  std::vector<double> reps_per_ms;
+  double mean;
+  double half_width;    /* Of the confidence interval of the mean */
+};
+
+/*
+ * Instead of running every timeout, find the timeout where reps stop scaling
+ * linearly with the timeout, i.e. where reps/ms drop by more than --threshold
+ * compared to the shortest timeout. Each timeout is sampled until the
+ * confidence interval of its mean reps/ms is narrower than --precision, and
+ * the timeout axis is bisected down to --resolution-us.
+ */
+static int adaptive(options const &opts)
+{
+  double precision = opts.get_double("precision", 0.01);
+  double threshold = opts.get_double("threshold", 0.1);
+  double confidence = opts.get_double("confidence", 0.95);
+  uint64_t min_samples = std::max<uint64_t>(opts.get_u64("min-samples", 5), 2);
+  uint64_t max_samples = opts.get_u64("max-samples", 200);
+  std::chrono::nanoseconds lo = std::chrono::milliseconds { opts.get_u64("min-timeout", 1) };
+  std::chrono::nanoseconds hi = std::chrono::milliseconds { opts.get_u64("max-timeout", 49) };
+  std::chrono::nanoseconds resolution = std::chrono::microseconds { opts.get_u64("resolution-us", 500) };
+  std::unique_ptr<result_log_writer> log;
+
+  die_on(lo >= hi or lo.count() == 0 or resolution.count() == 0, "invalid timeout range");
+
+  if (opts.has("log"))
+    log.reset(new result_log_writer { opts.get("log", "").c_str(), host_fingerprint {}.to_string() });
+
+  result_collector collector { 1, opts.get_u64("ring-size", 1024), log.get(), nullptr, false };
+  std::map<int64_t, adaptive_point> points;
+  std::chrono::nanoseconds slice_time {};
+  uint64_t slices = 0;
+  double z = normal_quantile(1 - (1 - confidence) / 2);
+
+  timeout_vm vm;
+
+  auto measure = [&] (std::chrono::nanoseconds timeout) -> adaptive_point const & {
+    auto it = points.find(timeout.count());
+    if (it != points.end())
+      return it->second;
+
+    adaptive_point &point = points[timeout.count()];
+
+    for (;;) {
+      slice_record record = run_slice(vm, timeout);
+
+      collector.ring(0).push(record);
+      slice_time += std::chrono::nanoseconds { record[col_wall_ns] };
+      slices++;
+
+      point.reps_per_ms.push_back(record[col_reps] * 1e6 / record[col_wall_ns]);
+
+      size_t n = point.reps_per_ms.size();
+      if (n < min_samples)
+        continue;
+
+      point.mean = mean(point.reps_per_ms.data(), n);
+      point.half_width = z * stddev(point.reps_per_ms.data(), n) / std::sqrt(double(n));
+
+      if (point.half_width <= precision * point.mean or n >= max_samples)
+        break;
+    }
+
+    std::cout << "timeout " << std::fixed << std::setprecision(3) << timeout.count() / 1e6 << "ms: "
+              << point.reps_per_ms.size() << " slices, " << std::setprecision(1) << point.mean << " +- "
+              << point.half_width << " reps/ms\n";
+    return point;
+  };
+
+  double baseline = measure(lo).mean;
+  auto scales = [&] (std::chrono::nanoseconds timeout) { return measure(timeout).mean >= (1 - threshold) * baseline; };
+
+  if (scales(hi)) {
+    std::cout << "reps scale linearly up to " << hi.count() / 1e6 << "ms\n";
+  } else {
+    // Invariant: reps still scale at lo, but not at hi.
+    while (hi - lo > resolution) {
+      auto mid = lo + (hi - lo) / 2;
+      (scales(mid) ? lo : hi) = mid;
+    }
+
+    std::cout << "reps stop scaling linearly between " << std::setprecision(3) << lo.count() / 1e6 << "ms and "
+              << hi.count() / 1e6 << "ms\n";
+  }
+
+  std::cout << slices << " slices at " << points.size() << " timeouts in " << std::setprecision(1)
+            << slice_time.count() / 1e6 << "ms of guest time\n";
+
+  return collector.finish() == 0 ? 0 : EXIT_FAILURE;
+}
+
+static volatile sig_atomic_t probe_stop = 0;
+
+static void probe_stop_handler(int) { probe_stop = 1; }
+
+/*
+ * Why a probe slice was slow. Off-CPU time that the scheduler accounts as run
+ * delay is steal by other tasks. Off-CPU time where the thread went to sleep
+ * on its own is the split lock mitigation putting it to sleep. Slow slices
+ * without off-CPU time mean the core itself got slower.
+ */
+static char const *probe_cause(slice_record const &record, sched_stats const &before, sched_stats const &after,
+                               uint64_t bus_lock_exits, double cpu_rate, double cpu_baseline, double drop)
+{
+  double off_cpu_ns = record[col_wall_ns] - record[col_cpu_ns];
+  double run_delay_ns = (after.run_delay - before.run_delay).count();
+
+  if (off_cpu_ns > drop * record[col_wall_ns]) {
+    if (run_delay_ns >= off_cpu_ns / 2)
+      return "steal";
+    if (after.voluntary_switches > before.voluntary_switches or bus_lock_exits)
+      return "split-lock-throttling";
+    return "off-cpu";
+  }
+
+  if (cpu_rate < (1 - drop) * cpu_baseline)
+    return "frequency-loss";
+
+  return "unknown";
+}
+
+/*
+ * Long-running probe for production hosts: run one short slice every now and
+ * then, track the reps/ms baseline as an exponentially weighted moving average
+ * and report slices that fall more than --drop below it. The pause between
+ * slices is chosen so that the probe uses at most --budget of one CPU.
+ */
+static int probe(options const &opts)
+{
+  std::chrono::nanoseconds slice = std::chrono::microseconds { opts.get_u64("slice-us", 1000) };
+  double budget = opts.get_double("budget", 0.001);
+  double alpha = opts.get_double("alpha", 0.05);
+  double drop = opts.get_double("drop", 0.2);
+  uint64_t warmup = std::max<uint64_t>(opts.get_u64("warmup", 10), 1);
+  uint64_t max_slices = opts.get_u64("slices", 0);    /* 0 means run until SIGINT or SIGTERM */
+
+  die_on(slice.count() == 0, "probe slice must not be empty");
+  die_on(budget <= 0 or budget > 1, "CPU budget must be in (0, 1]");
+  die_on(alpha <= 0 or alpha > 1, "EWMA weight must be in (0, 1]");
+
+  bool bus_lock_exit = opts.has("bus-lock-exit");
+  timeout_vm vm { bus_lock_exit ? vm_bus_lock_exit : 0u };
+  vcpu_metrics metrics;
+  std::unique_ptr<metrics_server> server;
+
+  vm.set_metrics(&metrics);
+
+  if (opts.has("metrics-socket"))
+    server.reset(new metrics_server { opts.get("metrics-socket", ""), { &metrics } });
+
+  struct sigaction sa {};
+  sa.sa_handler = probe_stop_handler;
+  die_on(sigaction(SIGINT, &sa, nullptr) < 0, "sigaction");
+  die_on(sigaction(SIGTERM, &sa, nullptr) < 0, "sigaction");
+
+  auto start = std::chrono::steady_clock::now();
+  double baseline = 0, cpu_baseline = 0;
+  uint64_t alerts = 0;
+
+  std::cout << std::fixed << std::setprecision(1);
+
+  for (uint64_t n = 0; not probe_stop and (max_slices == 0 or n < max_slices); n++) {
+    auto cpu_start = thread_cpu_time();
+    auto period_start = std::chrono::steady_clock::now();
+    uint64_t bus_locks_before = vm.bus_lock_exits();
+    sched_stats before = sched_stats::current();
+    slice_record record = run_slice(vm, slice);
+    sched_stats after = sched_stats::current();
+
+    metrics.count_slice(record);
+
+    double rate = record[col_reps] * 1e6 / record[col_wall_ns];
+    double cpu_rate = record[col_cpu_ns] > 0 ? record[col_reps] * 1e6 / record[col_cpu_ns] : rate;
+    double t = std::chrono::duration<double>(period_start - start).count();
+
+    if (n < warmup) {
+      // Start with the plain average, so the first slice doesn't dominate.
+      baseline += (rate - baseline) / (n + 1);
+      cpu_baseline += (cpu_rate - cpu_baseline) / (n + 1);
+
+      if (n + 1 == warmup)
+        std::cout << "baseline t=" << t << "s reps_per_ms=" << baseline << std::endl;
+    } else if (rate < (1 - drop) * baseline) {
+      // Slow slices don't move the baseline, otherwise a long throttling period would become the norm.
+      alerts++;
+      std::cout << "alert t=" << t << "s reps_per_ms=" << rate << " baseline=" << baseline
+                << " off_cpu_us=" << (record[col_wall_ns] - record[col_cpu_ns]) / 1e3
+                << " run_delay_us=" << (after.run_delay - before.run_delay).count() / 1e3
+                << " cause=" << probe_cause(record, before, after, vm.bus_lock_exits() - bus_locks_before,
+                                            cpu_rate, cpu_baseline, drop)
+                << std::endl;
+    } else {
+      baseline += alpha * (rate - baseline);
+      cpu_baseline += alpha * (cpu_rate - cpu_baseline);
+    }
+
+    // Everything this loop iteration cost counts against the budget, not just the guest.
+    std::chrono::duration<double> used = thread_cpu_time() - cpu_start;
+    auto next = period_start + std::chrono::duration_cast<std::chrono::nanoseconds>(used / budget);
+
+    std::this_thread::sleep_until(next);
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "stopped after " << metrics.slices.get() << " slices in " << elapsed.count() << "s, " << alerts
+            << " alerts, CPU " << std::setprecision(3) << 100 * thread_cpu_time().count() / 1e9 / elapsed.count()
+            << "%" << std::endl;
+
+  return 0;
+}
+
+/*
+ * Estimate how much CPU time other tasks take away from the vCPU. A calibration
+ * phase learns how many iterations of the ALU loop the vCPU manages per
+ * nanosecond it is actually running. Afterwards, every slice that falls short
+ * of that rate times its wall-clock time is counted as steal. The estimate is
+ * printed next to the two direct measurements it should agree with: the gap
+ * between wall-clock and thread CPU time, and the scheduler's run delay.
+ */
+static int steal(options const &opts)
+{
+  std::chrono::nanoseconds slice = std::chrono::milliseconds { opts.get_u64("slice-ms", 10) };
+  uint64_t calibration_slices = std::max<uint64_t>(opts.get_u64("calibrate", 20), 1);
+  uint64_t slices = opts.get_u64("slices", 100);
+  guest_entry entry = guest_entry::alu_loop;
+
+  die_on(slice.count() == 0, "steal slice must not be empty");
+
+  timeout_vm vm;
+  std::vector<double> reps_per_cpu_ns;
+
+  for (uint64_t i = 0; i < calibration_slices; i++) {
+    slice_record record = run_slice(vm, slice, entry);
+
+    if (record[col_cpu_ns] > 0)
+      reps_per_cpu_ns.push_back(double(record[col_reps]) / record[col_cpu_ns]);
+  }
+
+  die_on(reps_per_cpu_ns.empty(), "no CPU time during calibration");
+
+  // The median ignores slices that were disturbed during calibration.
+  double expected = quantile(reps_per_cpu_ns, 0.5);
+  std::vector<double> estimated, cpu_gap, run_delay;
+
+  std::cout << std::fixed << std::setprecision(3) << "calibrated " << expected << " reps/ns\n"
+            << std::setprecision(1);
+
+  for (uint64_t i = 0; i < slices; i++) {
+    sched_stats before = sched_stats::current();
+    slice_record record = run_slice(vm, slice, entry);
+    sched_stats after = sched_stats::current();
+    double wall = record[col_wall_ns];
+
+    estimated.push_back(std::max(0.0, 100 * (1 - record[col_reps] / (expected * wall))));
+    cpu_gap.push_back(std::max(0.0, 100 * (wall - record[col_cpu_ns]) / wall));
+    run_delay.push_back(100 * (after.run_delay - before.run_delay).count() / wall);
+
+    std::cout << "slice " << i << ": steal " << estimated.back() << "% (CPU time gap " << cpu_gap.back()
+              << "%, run delay " << run_delay.back() << "%)\n";
+  }
+
+  if (slices)
+    std::cout << "mean steal " << mean(estimated.data(), slices) << "% (CPU time gap "
+              << mean(cpu_gap.data(), slices) << "%, run delay " << mean(run_delay.data(), slices) << "%)\n";
+
+  return 0;
+}
+
+/*
+ * Check the steal time that KVM reports to the guest. The guest samples its
+ * steal time counter in every iteration, and each slice compares how much it
+ * grew with the host's view of how long the vCPU thread didn't run: the gap
+ * between wall-clock and thread CPU time, and the scheduler's run delay.
+ * KVM derives steal time from the run delay, so time the thread spends
+ * sleeping, e.g. when split lock mitigation throttles it, is not steal.
+ */
+static int guest_steal(options const &opts)
+{
+  std::chrono::nanoseconds slice = std::chrono::milliseconds { opts.get_u64("slice-ms", 10) };
+  uint64_t slices = opts.get_u64("slices", 100);
+  std::string workload = opts.get("workload", "split-lock");
+
+  die_on(slice.count() == 0, "steal slice must not be empty");
+  die_on(workload != "split-lock" and workload != "alu", "--workload must be split-lock or alu");
+
+  timeout_vm vm { 0, 1u << KVM_FEATURE_STEAL_TIME };
+  std::vector<double> guest, cpu_gap, run_delay;
+  kvm_regs args {};
+
+  vm.enable_steal_time(vm.shared_gpa());
+
+  args.rsi = vm.shared_gpa();
+  args.rdi = workload == "split-lock";
+  vm.start(guest_entry::steal_loop, args);
+
+  // An unmeasured first slice gives us the steal the guest saw before the measurement.
+  vm.arm_timer(slice);
+  while (not (vm.resume() & timeout_vcpu::timer_expired))
+    ;
+
+  uint64_t steal_before = vm.get_regs().r14;
+
+  std::cout << std::fixed << std::setprecision(1);
+
+  for (uint64_t i = 0; i < slices; i++) {
+    sched_stats sched_before = sched_stats::current();
+    auto cpu_before = thread_cpu_time();
+    auto time_before = std::chrono::steady_clock::now();
+
+    vm.arm_timer(slice);
+    while (not (vm.resume() & timeout_vcpu::timer_expired))
+      ;
+
+    auto time_after = std::chrono::steady_clock::now();
+    auto cpu_after = thread_cpu_time();
+    sched_stats sched_after = sched_stats::current();
+    uint64_t steal_after = vm.get_regs().r14;
+    double wall = std::chrono::nanoseconds { time_after - time_before }.count();
+
+    guest.push_back(100 * (steal_after - steal_before) / wall);
+    cpu_gap.push_back(std::max(0.0, 100 * (wall - (cpu_after - cpu_before).count()) / wall));
+    run_delay.push_back(100 * (sched_after.run_delay - sched_before.run_delay).count() / wall);
+    steal_before = steal_after;
+
+    std::cout << "slice " << i << ": guest steal " << guest.back() << "% (CPU time gap " << cpu_gap.back()
+              << "%, run delay " << run_delay.back() << "%)\n";
+  }
+
+  if (slices)
+    std::cout << "mean guest steal " << mean(guest.data(), slices) << "% (CPU time gap "
+              << mean(cpu_gap.data(), slices) << "%, run delay " << mean(run_delay.data(), slices) << "%)\n";
+
+  return 0;
+}
+
+/* The lock of the spinlock workloads in guest.asm. */
+struct guest_spinlock {
+  static const unsigned max_vcpus = 64;
+
+  uint64_t next_ticket;
+  uint64_t now_serving;
+  uint64_t tas;
+  uint64_t reserved0[5];
+  uint64_t owner;       /* Owner id of the current holder or zero. In its own cache line. */
+  uint64_t reserved1[7];
+  uint64_t waiting[max_vcpus];    /* Ticket + 1 that a halted vCPU waits for, by APIC ID */
+};
+
+static_assert(offsetof(guest_spinlock, owner) == 64 and offsetof(guest_spinlock, waiting) == 128,
+              "Lock layout doesn't match guest.asm");
+
+/* How pv_lock_loop waits for a lock, see guest.asm. */
+enum class lock_wait : uint64_t {
+  spin,
+  halt,     /* Halt and let the releaser kick us with KVM_HC_KICK_CPU */
+  yield,    /* Yield to the lock holder with KVM_HC_SCHED_YIELD */
+};
+
+/* Registers for a spinlock workload on one of several vCPUs. */
+template <typename RUNNER>
+static kvm_regs spinlock_args(RUNNER &vm, unsigned vcpu, unsigned vcpus, uint64_t critical,
+                              lock_wait wait = lock_wait::spin, uint64_t spin_threshold = 1024)
+{
+  kvm_regs args {};
+
+  die_on(critical == 0 or spin_threshold == 0, "critical section and spin threshold must not be empty");
+  die_on(vcpus > guest_spinlock::max_vcpus, "too many vCPUs for the lock");
+
+  args.rsi = vm.shared_gpa();
+  args.rdi = vcpu + 1;
+  args.rbx = critical;
+  args.r8 = critical;
+  args.r9 = vcpus;
+  args.r10 = spin_threshold;
+  args.r12 = static_cast<uint64_t>(wait);
+
+  return args;
+}
+
+/*
+ * Returns the initial registers for a guest workload and prepares the shared
+ * memory it uses. The runner is either a timeout_vm or a native_runner.
+ */
+template <typename RUNNER>
+static kvm_regs workload_args(RUNNER &vm, guest_entry entry, options const &opts)
+{
+  kvm_regs args {};
+
+  switch (entry) {
+  case guest_entry::slack_off:
+  case guest_entry::vector_loop:
+  case guest_entry::alu_loop:
+    break;
+  case guest_entry::ticket_lock_loop:
+  case guest_entry::tas_lock_loop:
+  case guest_entry::pv_lock_loop:
+    args = spinlock_args(vm, 0, 1, opts.get_u64("critical", 100));
+    *vm.template shared<guest_spinlock>() = {};
+    break;
+  case guest_entry::ipi_sender:
+  case guest_entry::ipi_receiver:
+  case guest_entry::tlb_shootdown:
+  case guest_entry::tlb_receiver:
+  case guest_entry::page_fault_loop:
+  case guest_entry::cr3_switch_loop:
+  case guest_entry::msr_loop:
+  case guest_entry::tsc_loop:
+  case guest_entry::kvmclock_loop:
+  case guest_entry::steal_loop:
+    fprintf(stderr, "workload '%s' only runs in its own mode\n", workload(entry).name);
+    exit(EXIT_FAILURE);
+  case guest_entry::slack_off_timeline:
+    args.rsi = vm.shared_gpa();
+    args.rbx = opts.get_u64("interval", 1000);
+    args.rcx = timeline_capacity - 1;
+
+    die_on(args.rbx == 0, "timeline interval must not be zero");
+    vm.template shared<timeline_ring>()->head = 0;
+    break;
+  }
+
+  return args;
+}
+
+/*
+ * Like sweep, but the guest also records its progress into a timeline ring. This
+ * shows how throughput develops within a single time slice.
+ */
+static int timeline(options const &opts)
+{
+  double bucket_ms = opts.get_double("bucket-ms", 1.0);
+  uint64_t max_timeout = opts.get_u64("max-timeout", 49);
+
+  die_on(bucket_ms <= 0, "invalid timeline bucket size");
+
+  timeout_vm vm;
+  auto ring = vm.shared<timeline_ring>();
+  uint32_t tsc_khz = vm.tsc_khz();
+
+  for (uint64_t timeout = 1; timeout <= max_timeout; timeout++) {
+    kvm_regs args = workload_args(vm, guest_entry::slack_off_timeline, opts);
+
+    vm.arm_timer(std::chrono::milliseconds{timeout});
+
+    auto time_before = std::chrono::steady_clock::now();
+    kvm_regs regs = vm.run(guest_entry::slack_off_timeline, args);
     auto time_after = std::chrono::steady_clock::now();
 
-    uint64_t actual_ms = std::chrono::duration_cast<std::chrono::milliseconds>(time_after - time_before).count();
+    uint64_t actual_ms = std::chrono::duration_cast<std::chrono::milliseconds>(time_after - time_before).count();
+
+    std::cout << "timeout " << timeout << "ms (took " << actual_ms <<  "ms) -> reps " << regs.r15;
+    if (ring->head > timeline_capacity)
+      std::cout << " (" << ring->head - timeline_capacity << " samples lost)";
+    std::cout << "\n";
+
+    for (auto const &point : decode_timeline(*ring, tsc_khz, bucket_ms))
+      std::cout << "  +" << std::fixed << std::setprecision(3) << std::setw(9) << point.time_ms
+                << "ms " << std::setprecision(1) << std::setw(12) << point.reps_per_ms << " reps/ms\n";
+  }
+
+  return 0;
+}
+
+/*
+ * Sample the guest instruction pointer by kicking the vCPU out of KVM_RUN at a
+ * fixed frequency from another thread. Samples are attributed to the closest
+ * preceding workload entry point.
+ */
+static int profile(options const &opts)
+{
+  uint64_t hz = opts.get_u64("hz", 1000);
+  auto duration = std::chrono::milliseconds { opts.get_u64("duration-ms", 1000) };
+  guest_entry entry = parse_guest_entry(opts.get("workload", "slack_off"));
+
+  die_on(hz == 0 or hz > 1000000000, "invalid sampling frequency");
+
+  timeout_vm vm;
+  bool sync_regs = vm.enable_sync_regs();
+
+  // Run once without kicks to know what the guest achieves undisturbed.
+  vm.arm_timer(duration);
+  uint64_t baseline_reps = vm.run(entry, workload_args(vm, entry, opts)).*workload(entry).iterations;
+
+  std::atomic<bool> done { false };
+  pthread_t vcpu_thread = pthread_self();
+  std::map<uint64_t, uint64_t> histogram;
+  uint64_t kicks = 0;
+  std::chrono::nanoseconds handling {};
+
+  std::thread kicker { [&done, vcpu_thread, hz] {
+      auto period = std::chrono::nanoseconds { 1000000000 / hz };
+      auto next = std::chrono::steady_clock::now();
+
+      while (not done) {
+        next += period;
+        std::this_thread::sleep_until(next);
+        pthread_kill(vcpu_thread, kick_signal);
+      }
+    } };
+
+  vm.arm_timer(duration);
+  vm.start(entry, workload_args(vm, entry, opts));
+
+  for (;;) {
+    unsigned pending = vm.resume();
+    auto handling_start = std::chrono::steady_clock::now();
+
+    if (pending & timeout_vm::kicked) {
+      histogram[sync_regs ? vm.synced_regs().rip : vm.get_regs().rip]++;
+      kicks++;
+    }
+
+    if (pending & timeout_vm::timer_expired)
+      break;
+
+    handling += std::chrono::steady_clock::now() - handling_start;
+  }
+
+  uint64_t profiled_reps = vm.get_regs().*workload(entry).iterations;
+
+  done = true;
+  kicker.join();
+  vm.consume_pending_signals();
+
+  std::cout << "profile " << workload(entry).name << " for " << duration.count() << "ms at " << hz << "Hz using "
+            << (sync_regs ? "sync regs" : "KVM_GET_REGS") << "\n";
+  std::cout << "reps " << baseline_reps << " without kicks, " << profiled_reps << " with " << kicks << " kicks\n";
+
+  if (kicks == 0)
+    return 0;
+
+  // The throughput the guest lost compared to the baseline is the full cost of a kick, including the exit and
+  // re-entry in the kernel.
+  double ns_per_rep = std::chrono::duration<double, std::nano>(duration).count() / std::max<uint64_t>(baseline_reps, 1);
+  double lost_ns = (double(baseline_reps) - double(profiled_reps)) * ns_per_rep;
+
+  std::cout << "overhead per kick: " << std::fixed << std::setprecision(0) << lost_ns / kicks << "ns total, "
+            << double(handling.count()) / kicks << "ns in userspace\n";
+
+  // Symbolise against the workload entry points.
+  std::vector<std::pair<uint64_t, guest_entry>> symbols;
+  for (unsigned i = 0; i < guest_workload_count; i++)
+    symbols.emplace_back(guest_entry_address(static_cast<guest_entry>(i)), static_cast<guest_entry>(i));
+  std::sort(symbols.begin(), symbols.end());
+
+  std::vector<std::pair<uint64_t, uint64_t>> by_count { histogram.begin(), histogram.end() };
+  std::sort(by_count.begin(), by_count.end(),
+            [] (std::pair<uint64_t, uint64_t> const &a, std::pair<uint64_t, uint64_t> const &b) {
+              return a.second > b.second;
+            });
+
+  std::cout << "  samples       %  rip               symbol\n";
+  for (auto const &sample : by_count) {
+    auto sym = std::upper_bound(symbols.begin(), symbols.end(), std::make_pair(sample.first, guest_entry {}),
+                                [] (std::pair<uint64_t, guest_entry> const &a, std::pair<uint64_t, guest_entry> const &b) {
+                                  return a.first < b.first;
+                                });
+
+    std::cout << std::setw(9) << sample.second << std::setw(8) << std::setprecision(1)
+              << 100.0 * sample.second / kicks << "  0x" << std::hex << std::setfill('0') << std::setw(16)
+              << sample.first << std::dec << std::setfill(' ') << "  ";
+
+    if (sym == symbols.begin())
+      std::cout << "?\n";
+    else
+      std::cout << workload((sym - 1)->second).name << "+0x" << std::hex << sample.first - (sym - 1)->first
+                << std::dec << "\n";
+  }
+
+  return 0;
+}
+
+/* A lock implementation for the lock benchmark. */
+struct lock_kind {
+  char const *name;
+  guest_entry entry;
+  lock_wait wait;
+  uint32_t pv_features;   /* KVM_FEATURE_* bits the guest needs */
+};
+
+static lock_kind const lock_kinds[] {
+  { "ticket",   guest_entry::ticket_lock_loop, lock_wait::spin,  0 },
+  { "tas",      guest_entry::tas_lock_loop,    lock_wait::spin,  0 },
+  { "pv-spin",  guest_entry::pv_lock_loop,     lock_wait::spin,  0 },
+  { "pv-kick",  guest_entry::pv_lock_loop,     lock_wait::halt,  1u << KVM_FEATURE_PV_UNHALT },
+  { "pv-yield", guest_entry::pv_lock_loop,     lock_wait::yield, 1u << KVM_FEATURE_PV_SCHED_YIELD },
+};
+
+static lock_kind const &parse_lock_kind(std::string const &name)
+{
+  for (auto const &kind : lock_kinds)
+    if (name == kind.name)
+      return kind;
+
+  fprintf(stderr, "unknown lock '%s'\n", name.c_str());
+  exit(EXIT_FAILURE);
+}
+
+/* Parameters of one lock benchmark run. */
+struct lhp_config {
+  lock_kind kind;
+  unsigned vcpus;
+  unsigned cpus;                          /* Host CPUs to run the vCPU threads on, 0 for all */
+  unsigned features;                      /* vm_feature bits */
+  std::chrono::nanoseconds duration;
+  uint64_t critical;
+  uint64_t spin_threshold;
+  uint64_t preempt_hz;                    /* 0 for no deliberate preemption */
+  std::chrono::nanoseconds preempt_for;
+};
+
+/* What the vCPUs of one lock benchmark run achieved together. */
+struct lhp_result {
+  uint64_t acquisitions = 0;
+  uint64_t spins = 0;         /* PAUSE iterations while waiting for the lock */
+  uint64_t wait_cycles = 0;   /* TSC cycles from taking a ticket to getting the lock, PV lock only */
+  uint64_t sleeps = 0;        /* Halts or yields, PV lock only */
+  uint64_t preemptions = 0;
+  std::chrono::nanoseconds cpu_time {};
+  uint32_t tsc_khz = 0;
+};
+
+/*
+ * Runs a spinlock workload on several vCPUs of a new VM, each on its own
+ * thread. With a non-zero preempt_hz, the calling thread kicks whichever vCPU
+ * holds the lock at that frequency, and the kicked vCPU thread sleeps for
+ * preempt_for before it re-enters the guest, just like a lock holder whose
+ * thread the host scheduler took off the CPU.
+ */
+static lhp_result run_lhp(lhp_config const &config)
+{
+  unsigned features = config.features;
+
+  if (config.kind.entry == guest_entry::pv_lock_loop)
+    features |= vm_irqchip;
+
+  guest_vm vm { features, config.kind.pv_features };
+  auto lock = vm.shared<guest_spinlock>();
+  std::vector<lhp_result> results(config.vcpus);
+  std::vector<std::thread> threads;
+  std::atomic<unsigned> ready { 0 }, finished { 0 };
+
+  *lock = {};
+
+  for (unsigned i = 0; i < config.vcpus; i++)
+    threads.emplace_back([&, i] {
+        pin_to_cpus(config.cpus);
+
+        timeout_vcpu vcpu { vm, int(i) };
+
+        // Start all vCPUs at the same time.
+        ready++;
+        while (ready != config.vcpus)
+          std::this_thread::yield();
+
+        auto cpu_before = thread_cpu_time();
+
+        vcpu.arm_timer(config.duration);
+        vcpu.start(config.kind.entry, spinlock_args(vm, i, config.vcpus, config.critical, config.kind.wait,
+                                                    config.spin_threshold));
+
+        for (;;) {
+          unsigned pending = vcpu.resume();
+
+          if (pending & timeout_vcpu::timer_expired)
+            break;
+
+          if (pending & timeout_vcpu::kicked) {
+            std::this_thread::sleep_for(config.preempt_for);
+            results[i].preemptions++;
+
+            // Kicks that land while we are already out of the guest didn't preempt anything.
+            if (vcpu.consume_pending_signals() & timeout_vcpu::timer_expired)
+              break;
+          }
+        }
+
+        kvm_regs regs = vcpu.get_regs();
+
+        results[i].acquisitions = regs.*workload(config.kind.entry).iterations;
+        results[i].spins = regs.r14;
+        results[i].wait_cycles = regs.r13;
+        results[i].sleeps = regs.r11;
+        results[i].cpu_time = thread_cpu_time() - cpu_before;
+        results[i].tsc_khz = vcpu.tsc_khz();
+        finished++;
+      });
+
+  // Only kick once all vCPU threads have blocked the kick signal.
+  while (ready != config.vcpus)
+    std::this_thread::yield();
+
+  if (config.preempt_hz != 0) {
+    auto period = std::chrono::nanoseconds { 1000000000 / config.preempt_hz };
+    auto next = std::chrono::steady_clock::now();
+
+    while (finished == 0) {
+      next += period;
+      std::this_thread::sleep_until(next);
+
+      uint64_t owner = *static_cast<uint64_t volatile *>(&lock->owner);
+      if (owner != 0 and owner <= config.vcpus)
+        pthread_kill(threads[owner - 1].native_handle(), kick_signal);
+    }
+  }
+
+  for (auto &thread : threads)
+    thread.join();
+
+  lhp_result total;
+
+  for (auto const &r : results) {
+    total.acquisitions += r.acquisitions;
+    total.spins += r.spins;
+    total.wait_cycles += r.wait_cycles;
+    total.sleeps += r.sleeps;
+    total.preemptions += r.preemptions;
+    total.cpu_time += r.cpu_time;
+    total.tsc_khz = r.tsc_khz;
+  }
+
+  return total;
+}
+
+static void print_lhp_result(char const *label, lhp_result const &r, std::chrono::nanoseconds duration)
+{
+  double acquisitions = std::max<uint64_t>(r.acquisitions, 1);
+
+  std::cout << "  " << label << std::setprecision(1) << r.acquisitions * 1e6 / duration.count()
+            << " acquisitions/ms, " << r.spins / acquisitions << " spins and "
+            << r.cpu_time.count() / acquisitions << "ns CPU time per acquisition";
+
+  if (r.wait_cycles and r.tsc_khz)
+    std::cout << ", latency " << r.wait_cycles * 1e6 / r.tsc_khz / acquisitions << "ns";
+  if (r.sleeps)
+    std::cout << ", " << r.sleeps << " halts/yields";
+  if (r.preemptions)
+    std::cout << ", " << r.preemptions << " preemptions";
+
+  std::cout << "\n";
+}
+
+/*
+ * Quantify the cost of lock-holder preemption: several vCPUs contend on a
+ * guest spinlock, once undisturbed and once with the lock holder being
+ * descheduled on purpose. Both are measured with and without PAUSE-loop
+ * exiting, which lets KVM take spinning vCPUs off the CPU. With --cpus,
+ * the vCPU threads share fewer host CPUs than there are vCPUs.
+ */
+static int lhp(options const &opts)
+{
+  std::vector<lock_kind> kinds;
+  std::istringstream lock_names { opts.get("lock", "ticket") };
+  std::string name;
+  lhp_config config {};
+
+  while (std::getline(lock_names, name, ','))
+    kinds.push_back(parse_lock_kind(name));
+
+  config.vcpus = opts.get_u64("vcpus", 4);
+  config.cpus = opts.get_u64("cpus", 0);
+  config.duration = std::chrono::milliseconds { opts.get_u64("duration-ms", 1000) };
+  config.critical = opts.get_u64("critical", 100);
+  config.spin_threshold = opts.get_u64("spin-threshold", 1024);
+  config.preempt_for = std::chrono::microseconds { opts.get_u64("preempt-us", 1000) };
+
+  uint64_t preempt_hz = opts.get_u64("preempt-hz", 100);
+
+  die_on(kinds.empty(), "no lock given");
+  die_on(config.vcpus < 2 or config.vcpus > guest_spinlock::max_vcpus, "invalid number of vCPUs");
+  die_on(preempt_hz == 0 or preempt_hz > 1000000000, "invalid preemption frequency");
+
+  std::vector<std::pair<char const *, unsigned>> ple_configs { { "PLE on", 0 } };
+
+  if (kvm {}.check_extension(KVM_CAP_X86_DISABLE_EXITS) & KVM_X86_DISABLE_EXITS_PAUSE)
+    ple_configs.emplace_back("PLE off", vm_disable_pause_exits);
+  else
+    std::cout << "host can't disable PAUSE exits, only measuring with PLE\n";
+
+  std::cout << config.vcpus << " vCPUs on " << (config.cpus ? std::to_string(config.cpus) : "all") << " CPUs for "
+            << config.duration.count() / 1000000 << "ms, holder preempted " << preempt_hz << " times/s for "
+            << config.preempt_for.count() / 1000 << "us\n" << std::fixed;
+
+  for (auto const &kind : kinds)
+    for (auto const &ple : ple_configs) {
+      config.kind = kind;
+      config.features = ple.second;
+
+      config.preempt_hz = 0;
+      lhp_result base = run_lhp(config);
+
+      config.preempt_hz = preempt_hz;
+      lhp_result preempted = run_lhp(config);
+
+      std::cout << kind.name << ", " << ple.first << ":\n";
+      print_lhp_result("undisturbed: ", base, config.duration);
+      print_lhp_result("preempted:   ", preempted, config.duration);
+      std::cout << "  throughput lost: " << std::setprecision(1)
+                << 100.0 * (1.0 - double(preempted.acquisitions) / std::max<uint64_t>(base.acquisitions, 1)) << "%";
+
+      if (preempted.preemptions) {
+        // Express the loss in time: how long the whole VM made no progress per preemption.
+        double lost_ns = (double(base.acquisitions) - double(preempted.acquisitions)) * config.duration.count() /
+                         std::max<uint64_t>(base.acquisitions, 1);
+        std::cout << ", " << std::setprecision(0) << lost_ns / 1e3 / preempted.preemptions << "us per preemption";
+      }
+
+      std::cout << "\n";
+    }
+
+  return 0;
+}
+
+/* What one vCPU thread of the overcommit benchmark measured. */
+struct overcommit_vcpu {
+  uint64_t reps = 0;
+  std::chrono::nanoseconds wall {}, cpu {}, run_delay {};
+  uint64_t voluntary_switches = 0, involuntary_switches = 0;
+  std::vector<double> overshoot_us;
+};
+
+/*
+ * Run more vCPUs than there are host CPUs and see how the host scheduler
+ * shares the CPUs between them. The vCPUs are spread round-robin over --vms
+ * VMs, and all vCPU threads are pinned to the first --cpus host CPUs. Each
+ * vCPU runs --slices time slices of the guest workload back to back.
+ */
+static int overcommit(options const &opts)
+{
+  unsigned vcpus = opts.get_u64("vcpus", 4);
+  unsigned vms = opts.get_u64("vms", 1);
+  unsigned cpus = opts.get_u64("cpus", 1);
+  uint64_t slices = opts.get_u64("slices", 100);
+  std::chrono::nanoseconds slice = std::chrono::milliseconds { opts.get_u64("slice-ms", 10) };
+  guest_entry entry = parse_guest_entry(opts.get("workload", "slack_off"));
+
+  die_on(vcpus == 0 or vms == 0 or vms > vcpus, "need at least one vCPU per VM");
+  die_on(slices == 0 or slice.count() == 0, "need at least one non-empty slice");
+  die_on(entry == guest_entry::slack_off_timeline, "the timeline workload needs the timeline mode");
+
+  bool lock = entry == guest_entry::ticket_lock_loop or entry == guest_entry::tas_lock_loop or
+              entry == guest_entry::pv_lock_loop;
+
+  std::vector<std::unique_ptr<guest_vm>> guests;
+  std::vector<overcommit_vcpu> results(vcpus);
+  std::vector<std::thread> threads;
+  std::atomic<unsigned> ready { 0 };
+
+  for (unsigned i = 0; i < vms; i++) {
+    guests.emplace_back(new guest_vm);
+    *guests.back()->shared<guest_spinlock>() = {};
+  }
+
+  for (unsigned i = 0; i < vcpus; i++)
+    threads.emplace_back([&, i] {
+        guest_vm &vm = *guests[i % vms];
+        overcommit_vcpu &result = results[i];
+
+        pin_to_cpus(cpus);
+
+        timeout_vcpu vcpu { vm, int(i / vms) };
+
+        /* Thread i is vCPU i / vms of VM i % vms and takes that VM's lock in its own slot. */
+        unsigned vm_vcpus = vcpus / vms + (i % vms < vcpus % vms ? 1 : 0);
+        kvm_regs args = lock ? spinlock_args(vm, i / vms, vm_vcpus, opts.get_u64("critical", 100))
+                             : workload_args(vm, entry, opts);
+
+        ready++;
+        while (ready != vcpus)
+          std::this_thread::yield();
+
+        sched_stats before = sched_stats::current();
+        uint64_t reps_before = 0;
+
+        /* Restarting a vCPU that holds the lock would wedge the others, so start it only once. */
+        vcpu.start(entry, args);
+
+        for (uint64_t n = 0; n < slices; n++) {
+          slice_record record = run_slice(vcpu, slice, entry, args, false);
+
+          result.reps += record[col_reps] - reps_before;
+          result.wall += std::chrono::nanoseconds { record[col_wall_ns] };
+          result.cpu += std::chrono::nanoseconds { record[col_cpu_ns] };
+          result.overshoot_us.push_back(record[col_overshoot_ns] / 1e3);
+          reps_before = record[col_reps];
+        }
+
+        sched_stats after = sched_stats::current();
+
+        result.run_delay = after.run_delay - before.run_delay;
+        result.voluntary_switches = after.voluntary_switches - before.voluntary_switches;
+        result.involuntary_switches = after.involuntary_switches - before.involuntary_switches;
+      });
+
+  for (auto &thread : threads)
+    thread.join();
+
+  std::vector<double> reps_per_ms, overshoot_us;
+  uint64_t switches = 0;
+  std::chrono::nanoseconds wall {};
+
+  std::cout << vcpus << " vCPUs in " << vms << " VMs on " << cpus << " CPUs, " << workload(entry).name << ", "
+            << slices << " slices of " << slice.count() / 1000000 << "ms\n"
+            << "  vcpu  reps/ms  cpu share  run delay  switches/s (voluntary, involuntary)\n" << std::fixed;
+
+  for (unsigned i = 0; i < vcpus; i++) {
+    auto const &r = results[i];
+    double seconds = r.wall.count() / 1e9;
+
+    reps_per_ms.push_back(r.reps * 1e6 / r.wall.count());
+    overshoot_us.insert(overshoot_us.end(), r.overshoot_us.begin(), r.overshoot_us.end());
+    switches += r.voluntary_switches + r.involuntary_switches;
+    wall = std::max(wall, r.wall);
+
+    std::cout << std::setw(6) << i << std::setw(9) << std::setprecision(1) << reps_per_ms.back()
+              << std::setw(10) << 100.0 * r.cpu.count() / r.wall.count() << "%"
+              << std::setw(10) << 100.0 * r.run_delay.count() / r.wall.count() << "%"
+              << std::setw(12) << (r.voluntary_switches + r.involuntary_switches) / seconds << " (" << r.voluntary_switches << ", "
+              << r.involuntary_switches << ")\n";
+  }
+
+  std::cout << std::setprecision(3) << "Jain's fairness index " << jain_index(reps_per_ms.data(), vcpus)
+            << ", aggregate " << std::setprecision(1)
+            << std::accumulate(reps_per_ms.begin(), reps_per_ms.end(), 0.0) << " reps/ms\n"
+            << "overshoot p50 " << quantile(overshoot_us, 0.5) << "us, p99 " << quantile(overshoot_us, 0.99)
+            << "us, p99.9 " << quantile(overshoot_us, 0.999) << "us, max " << quantile(overshoot_us, 1.0) << "us\n"
+            << "context switches " << switches / (wall.count() / 1e9) << "/s\n";
+
+  return 0;
+}
+
+/* A guest context of the round-robin scheduler. */
+struct guest_context {
+  timeout_vcpu::context_state state;
+  std::unique_ptr<guest_memory> memory;
+  uint64_t reps = 0;
+};
+
+/*
+ * A userspace scheduler that multiplexes --contexts independent guest contexts
+ * on one vCPU. Each context has its own register state and its own memory
+ * region, which workloads that take a memory pointer in rsi use instead of the
+ * shared memory. The slack_off workloads hammer scratchspace in the guest
+ * image, which all contexts would share, so they are rejected. At each slice
+ * boundary, the state of the current context is saved and the next one is
+ * restored. The cost of this is measured directly and as throughput lost
+ * compared to running a single context.
+ */
+static int contexts(options const &opts)
+{
+  unsigned count = opts.get_u64("contexts", 4);
+  uint64_t rounds = opts.get_u64("rounds", 100);
+  std::chrono::nanoseconds slice = std::chrono::microseconds { opts.get_u64("slice-us", 1000) };
+  guest_entry entry = parse_guest_entry(opts.get("workload", "ticket_lock_loop"));
+
+  if (entry == guest_entry::slack_off or entry == guest_entry::slack_off_timeline) {
+    fprintf(stderr, "workload '%s' uses memory in the guest image that contexts would share\n", workload(entry).name);
+    return EXIT_FAILURE;
+  }
+
+  // Context memory starts after the shared memory.
+  uint64_t const context_base = 4 << 20;
+  uint64_t const context_size = 2 << 20;
+
+  die_on(count == 0 or rounds == 0 or slice.count() == 0, "need contexts, rounds and a slice length");
+  die_on(context_base + count * context_size > (1ULL << 30), "contexts don't fit in the identity mapping");
+
+  timeout_vm vm;
+  std::vector<guest_context> guests(count);
+  auto iterations = workload(entry).iterations;
+
+  for (unsigned i = 0; i < count; i++) {
+    guests[i].memory.reset(new guest_memory { &vm.get_kvm(), context_base + i * context_size, context_size });
+
+    kvm_regs args = workload_args(vm, entry, opts);
+    args.rsi = guests[i].memory->gpa();
+
+    vm.start(entry, args);
+    guests[i].state = vm.save_state();
+  }
+
+  // Throughput of a single context without switching, over the same guest time.
+  vm.arm_timer(slice * rounds * count);
+
+  auto baseline_start = std::chrono::steady_clock::now();
+  uint64_t baseline_reps = vm.run(entry, workload_args(vm, entry, opts)).*iterations;
+  std::chrono::nanoseconds baseline_time = std::chrono::steady_clock::now() - baseline_start;
+  double baseline = baseline_reps * 1e6 / baseline_time.count();
+
+  std::vector<double> switch_ns;
+  std::chrono::nanoseconds run_time {};
+
+  for (uint64_t round = 0; round < rounds; round++)
+    for (auto &guest : guests) {
+      auto restore_start = std::chrono::steady_clock::now();
+      vm.restore_state(guest.state);
+      auto restore_end = std::chrono::steady_clock::now();
+
+      uint64_t reps_before = guest.state.regs.*iterations;
+
+      vm.arm_timer(slice);
+      while (not (vm.resume() & timeout_vm::timer_expired))
+        ;
+
+      auto save_start = std::chrono::steady_clock::now();
+      guest.state = vm.save_state();
+      auto save_end = std::chrono::steady_clock::now();
+
+      guest.reps += guest.state.regs.*iterations - reps_before;
+      run_time += save_start - restore_end;
+      switch_ns.push_back(std::chrono::duration<double, std::nano>((restore_end - restore_start) +
+                                                                   (save_end - save_start)).count());
+    }
+
+  uint64_t reps = 0;
+
+  std::cout << count << " contexts of " << workload(entry).name << ", " << rounds << " rounds of "
+            << slice.count() / 1000 << "us slices\n" << std::fixed << std::setprecision(1);
+
+  for (unsigned i = 0; i < count; i++) {
+    reps += guests[i].reps;
+    std::cout << "  context " << i << ": " << guests[i].reps * 1e6 / (slice * rounds).count() << " reps/ms\n";
+  }
+
+  double switched = reps * 1e6 / run_time.count();
+
+  std::cout << "state switch p50 " << quantile(switch_ns, 0.5) << "ns, p99 " << quantile(switch_ns, 0.99)
+            << "ns\nsingle context " << baseline << " reps/ms, round-robin " << switched << " reps/ms ("
+            << 100.0 * (1.0 - switched / baseline) << "% lost)\n";
+
+  return 0;
+}
+
+/* Throughput and stop skew of a gang benchmark run. */
+struct gang_result {
+  uint64_t acquisitions = 0;
+  std::chrono::nanoseconds run_time {};
+  std::vector<double> stop_skew_us;
+};
+
+/*
+ * Run a lock workload on all vCPUs of a VM in time slices with a gap between
+ * them, in which the vCPU threads are off the guest like a descheduled VM.
+ * Gaps are jittered by up to +-50%. With gang scheduling, all vCPU threads wait
+ * at a barrier after each slice and then follow one schedule: the same
+ * absolute start time and deadline for every vCPU. Without it, every thread
+ * picks its own gap and arms its own relative timer.
+ */
+static gang_result run_gang(lock_kind const &kind, unsigned vcpus, bool gang, uint64_t slices,
+                            std::chrono::nanoseconds slice, std::chrono::nanoseconds gap, uint64_t critical)
+{
+  guest_vm vm { kind.entry == guest_entry::pv_lock_loop ? vm_irqchip : 0u, kind.pv_features };
+  std::vector<std::vector<std::chrono::nanoseconds>> lateness(slices, std::vector<std::chrono::nanoseconds>(vcpus));
+  std::vector<uint64_t> acquisitions(vcpus);
+  std::vector<std::thread> threads;
+  thread_barrier barrier { vcpus };
+  std::chrono::steady_clock::time_point start, deadline;
+  std::mt19937_64 schedule_rng { 1 };
+
+  *vm.shared<guest_spinlock>() = {};
+
+  auto jittered = [gap] (std::mt19937_64 &rng) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(gap * std::uniform_real_distribution<> { 0.5, 1.5 }(rng));
+  };
+
+  // Run by the last thread at the barrier: schedule the next slice for everyone.
+  auto schedule = [&] {
+    start = std::chrono::steady_clock::now() + jittered(schedule_rng);
+    deadline = start + slice;
+  };
+
+  for (unsigned i = 0; i < vcpus; i++)
+    threads.emplace_back([&, i] {
+        timeout_vcpu vcpu { vm, int(i) };
+        std::mt19937_64 rng { i + 2 };
+
+        vcpu.start(kind.entry, spinlock_args(vm, i, vcpus, critical, kind.wait));
+        barrier.wait(schedule);
+
+        for (uint64_t n = 0; n < slices; n++) {
+          std::chrono::steady_clock::time_point own_deadline;
+
+          if (gang) {
+            std::this_thread::sleep_until(start);
+            own_deadline = deadline;
+            vcpu.arm_timer_at(deadline);
+          } else {
+            std::this_thread::sleep_for(jittered(rng));
+            own_deadline = std::chrono::steady_clock::now() + slice;
+            vcpu.arm_timer(slice);
+          }
+
+          while (not (vcpu.resume() & timeout_vcpu::timer_expired))
+            ;
+
+          lateness[n][i] = std::chrono::steady_clock::now() - own_deadline;
+
+          if (gang)
+            barrier.wait(schedule);
+        }
+
+        acquisitions[i] = vcpu.get_regs().*workload(kind.entry).iterations;
+      });
+
+  for (auto &thread : threads)
+    thread.join();
+
+  gang_result result;
+
+  result.acquisitions = std::accumulate(acquisitions.begin(), acquisitions.end(), uint64_t(0));
+  result.run_time = slice * slices;
+
+  // Skew is the spread of how late each vCPU stopped after its own deadline, so
+  // independent timers aren't charged for the drift between their schedules.
+  for (auto const &slice_lateness : lateness) {
+    auto range = std::minmax_element(slice_lateness.begin(), slice_lateness.end());
+    result.stop_skew_us.push_back(std::chrono::duration<double, std::micro>(*range.second - *range.first).count());
+  }
+
+  return result;
+}
+
+/*
+ * Compare gang scheduling of all vCPUs of a VM with independent per-vCPU
+ * timers on a lock workload, where a vCPU that runs while the lock holder
+ * doesn't only wastes time.
+ */
+static int gang(options const &opts)
+{
+  lock_kind const &kind = parse_lock_kind(opts.get("lock", "ticket"));
+  unsigned vcpus = opts.get_u64("vcpus", 4);
+  uint64_t slices = opts.get_u64("slices", 200);
+  std::chrono::nanoseconds slice = std::chrono::microseconds { opts.get_u64("slice-us", 1000) };
+  std::chrono::nanoseconds gap = std::chrono::microseconds { opts.get_u64("gap-us", 1000) };
+  uint64_t critical = opts.get_u64("critical", 100);
+
+  die_on(vcpus < 2 or vcpus > guest_spinlock::max_vcpus, "invalid number of vCPUs");
+  die_on(slices == 0 or slice.count() == 0, "need at least one non-empty slice");
+
+  std::cout << kind.name << " on " << vcpus << " vCPUs, " << slices << " slices of " << slice.count() / 1000
+            << "us with " << gap.count() / 1000 << "us gaps\n" << std::fixed << std::setprecision(1);
+
+  double rates[2];
+
+  for (bool gang : { false, true }) {
+    gang_result r = run_gang(kind, vcpus, gang, slices, slice, gap, critical);
+
+    rates[gang] = r.acquisitions * 1e6 / r.run_time.count();
+    std::cout << (gang ? "gang:        " : "independent: ") << rates[gang] << " acquisitions/ms, stop skew p50 "
+              << quantile(r.stop_skew_us, 0.5) << "us, p99 " << quantile(r.stop_skew_us, 0.99) << "us, max "
+              << quantile(r.stop_skew_us, 1.0) << "us\n";
+  }
+
+  std::cout << "gang scheduling changes throughput by " << std::showpos << 100.0 * (rates[1] / rates[0] - 1.0)
+            << std::noshowpos << "%\n";
+
+  return 0;
+}
+
+/* Layout must match the comment above ipi_sender in guest.asm. */
+struct ipi_shared {
+  static const unsigned capacity = 65536;   /* IPI_CAPACITY */
+
+  struct slot {
+    uint64_t delivered_tsc;
+    uint64_t ready;
+    uint64_t reserved[6];
+  };
+
+  uint64_t samples_head;
+  uint64_t vcpus;
+  uint64_t use_hypercall;
+  uint64_t broadcast;
+  uint64_t delay_cycles;
+  uint64_t reserved[3];
+  slot slots[guest_vm::max_vcpus];
+  uint64_t samples[capacity];               /* Send-to-delivery latency in TSC cycles */
+};
+
+static_assert(offsetof(ipi_shared, slots) == 64 and offsetof(ipi_shared, samples) == 4160,
+              "ipi_shared doesn't match guest.asm");
+static_assert(sizeof(ipi_shared) <= 2 << 20, "ipi_shared doesn't fit into shared memory");
+
+/* How the IPI sender reaches its receivers. */
+struct ipi_method {
+  char const *name;
+  bool hypercall;
+  uint32_t pv_features;
+};
+
+static ipi_method const ipi_methods[] {
+  { "x2APIC ICR",  false, 0 },
+  { "PV send-IPI", true,  1u << KVM_FEATURE_PV_SEND_IPI },
+};
+
+struct ipi_result {
+  std::vector<double> latency_ns;
+  uint64_t ipis = 0;
+};
+
+/*
+ * Run the IPI workload on a new VM: vCPU 0 sends IPIs, all other vCPUs take
+ * them, each on its own thread, until the duration expires.
+ */
+static ipi_result run_ipi(ipi_method const &method, bool broadcast, unsigned vcpus, bool halt,
+                          std::chrono::nanoseconds duration, std::chrono::nanoseconds delay)
+{
+  guest_vm vm { vm_x2apic, method.pv_features };
+  auto shared = vm.shared<ipi_shared>();
+  std::vector<std::thread> threads;
+  std::vector<pthread_t> receivers(vcpus);
+  std::atomic<unsigned> ready { 0 };
+  std::atomic<bool> done { false };
+  std::atomic<uint32_t> tsc_khz { 0 };
+
+  memset(shared, 0, sizeof(*shared));
+  shared->vcpus = vcpus;
+  shared->use_hypercall = method.hypercall;
+  shared->broadcast = broadcast;
+
+  for (unsigned i = 0; i < vcpus; i++)
+    threads.emplace_back([&, i] {
+        timeout_vcpu vcpu { vm, int(i) };
+        kvm_regs args {};
+
+        receivers[i] = pthread_self();
+        ready++;
+
+        args.rsi = vm.shared_gpa();
+        if (i == 0) {
+          // Only kick receivers that have blocked the kick signal.
+          while (ready != vcpus)
+            std::this_thread::yield();
+
+          tsc_khz = vcpu.tsc_khz();
+          shared->delay_cycles = delay.count() * vcpu.tsc_khz() / 1000000;
+          vcpu.arm_timer(duration);
+          vcpu.start(guest_entry::ipi_sender, args);
+        } else {
+          args.r13 = vm.shared_gpa() + offsetof(ipi_shared, slots) + i * sizeof(ipi_shared::slot);
+          args.rdi = halt;
+          vcpu.start(guest_entry::ipi_receiver, args);
+        }
+
+        // The sender stops on its timer and then kicks the receivers.
+        while (not (vcpu.resume() & (timeout_vcpu::timer_expired | timeout_vcpu::kicked)) and not done)
+          ;
+
+        if (i == 0) {
+          done = true;
+          for (unsigned r = 1; r < vcpus; r++)
+            pthread_kill(receivers[r], kick_signal);
+        }
+      });
+
+  for (auto &thread : threads)
+    thread.join();
+
+  ipi_result result;
+
+  result.ipis = shared->samples_head;
+  for (uint64_t i = 0; i < std::min<uint64_t>(result.ipis, ipi_shared::capacity); i++)
+    result.latency_ns.push_back(shared->samples[i] * 1e6 / tsc_khz);
+
+  return result;
+}
+
+/*
+ * Measure how long it takes from sending an IPI until the receiving vCPU's
+ * interrupt handler runs, one receiver at a time and for all receivers at
+ * once, by x2APIC ICR writes and with the PV send-IPI hypercall.
+ */
+static int ipi(options const &opts)
+{
+  unsigned vcpus = opts.get_u64("vcpus", 2);
+  std::chrono::nanoseconds duration = std::chrono::milliseconds { opts.get_u64("duration-ms", 1000) };
+  std::chrono::nanoseconds delay = std::chrono::microseconds { opts.get_u64("delay-us", 10) };
+  std::string idle = opts.get("idle", "spin");
+
+  die_on(vcpus < 2 or vcpus >= guest_vm::max_vcpus, "invalid number of vCPUs");
+  die_on(idle != "spin" and idle != "halt", "--idle must be spin or halt");
+
+  uint32_t supported_pv = 0;
+
+  for (auto const &leaf : kvm {}.get_supported_cpuid())
+    if (leaf.function == KVM_CPUID_FEATURES)
+      supported_pv = leaf.eax;
+
+  host_fingerprint host;
+
+  for (auto const &v : host.values())
+    if (v.first == "kvm_intel.enable_apicv" or v.first == "kvm_amd.avic")
+      std::cout << v.first << "=" << v.second << "\n";
+
+  std::cout << vcpus << " vCPUs, receivers " << (idle == "halt" ? "halted" : "spinning") << ", "
+            << delay.count() / 1000 << "us between IPIs\n" << std::fixed << std::setprecision(0);
+
+  for (auto const &method : ipi_methods) {
+    if ((supported_pv & method.pv_features) != method.pv_features) {
+      std::cout << method.name << ": not supported by this host\n";
+      continue;
+    }
+
+    for (bool broadcast : { false, true }) {
+      ipi_result r = run_ipi(method, broadcast, vcpus, idle == "halt", duration, delay);
+
+      std::cout << method.name << (broadcast ? ", one-to-all: " : ", one-to-one: ") << r.ipis * 1e9 / duration.count()
+                << " IPIs/s";
+      if (not r.latency_ns.empty())
+        std::cout << ", latency p50 " << quantile(r.latency_ns, 0.5) << "ns, p90 " << quantile(r.latency_ns, 0.9)
+                  << "ns, p99 " << quantile(r.latency_ns, 0.99) << "ns, p99.9 " << quantile(r.latency_ns, 0.999)
+                  << "ns, max " << quantile(r.latency_ns, 1.0) << "ns";
+      std::cout << "\n";
+    }
+  }
+
+  return 0;
+}
+
+/* Layout must match the comment above tlb_shootdown in guest.asm. */
+struct tlb_shared {
+  static const unsigned capacity = 65536;   /* TLB_CAPACITY */
+
+  struct slot {
+    uint64_t acked_generation;
+    uint64_t ready;
+    uint64_t reserved[6];
+  };
+
+  uint64_t samples_head;
+  uint64_t vcpus;
+  uint64_t pv_flush;
+  uint64_t delay_cycles;
+  uint64_t pv_flushes;
+  uint64_t generation;
+  uint64_t pte_gpa;
+  uint64_t page;
+  uint64_t ptes[2];
+  uint64_t reserved[6];
+  slot slots[guest_vm::max_vcpus];
+  kvm_steal_time steal_time[guest_vm::max_vcpus];
+  uint64_t samples[capacity];               /* Shootdown latency in TSC cycles */
+};
+
+static_assert(offsetof(tlb_shared, slots) == 128 and offsetof(tlb_shared, steal_time) == 4224 and
+              offsetof(tlb_shared, samples) == 8320, "tlb_shared doesn't match guest.asm");
+static_assert(sizeof(kvm_steal_time) == 64, "unexpected kvm_steal_time size");
+
+/* The page that the shootdown benchmark remaps, and its two frames. It must be in shared memory. */
+static const uint64_t tlb_page = 0x1c0000;
+static constexpr uint64_t tlb_frames[2] { 0x1c1000, 0x1c2000 };
+
+static_assert(tlb_frames[1] + page_size <= page_table::small_pages_end, "TLB benchmark pages not 4K mapped");
+
+struct tlb_result {
+  std::vector<double> latency_ns;
+  uint64_t shootdowns = 0;
+  uint64_t pv_flushes = 0;
+};
+
+/*
+ * Run the TLB shootdown workload on a new VM: vCPU 0 remaps a page and
+ * flushes it everywhere, all other vCPUs keep reading from it, each on its
+ * own thread, restricted to the first `cpus` host CPUs.
+ */
+static tlb_result run_tlb(bool pv_flush, unsigned vcpus, unsigned cpus, std::chrono::nanoseconds duration,
+                          std::chrono::nanoseconds delay)
+{
+  guest_vm vm { vm_x2apic, pv_flush ? (1u << KVM_FEATURE_STEAL_TIME | 1u << KVM_FEATURE_PV_TLB_FLUSH) : 0u };
+  auto shared = vm.shared<tlb_shared>();
+  std::vector<std::thread> threads;
+  std::vector<pthread_t> receivers(vcpus);
+  std::atomic<unsigned> ready { 0 };
+  std::atomic<bool> done { false };
+  std::atomic<uint32_t> tsc_khz { 0 };
+
+  die_on(vm.shared_gpa() + sizeof(tlb_shared) > tlb_page, "tlb_shared overlaps the remapped page");
+  vm.page_tables().map_small_pages();
+
+  memset(shared, 0, sizeof(*shared));
+  shared->vcpus = vcpus;
+  shared->pv_flush = pv_flush;
+  shared->pte_gpa = vm.page_tables().pte_gpa(tlb_page);
+  shared->page = tlb_page;
+  shared->ptes[0] = vm.page_tables().pte(tlb_frames[0]);
+  shared->ptes[1] = vm.page_tables().pte(tlb_frames[1]);
+
+  for (unsigned i = 0; i < vcpus; i++)
+    threads.emplace_back([&, i] {
+        pin_to_cpus(cpus);
+
+        timeout_vcpu vcpu { vm, int(i) };
+        kvm_regs args {};
+
+        if (pv_flush)
+          vcpu.enable_steal_time(vm.shared_gpa() + offsetof(tlb_shared, steal_time) + i * sizeof(kvm_steal_time));
+
+        receivers[i] = pthread_self();
+        ready++;
+
+        args.rsi = vm.shared_gpa();
+        if (i == 0) {
+          // Only kick receivers that have blocked the kick signal.
+          while (ready != vcpus)
+            std::this_thread::yield();
+
+          tsc_khz = vcpu.tsc_khz();
+          shared->delay_cycles = delay.count() * vcpu.tsc_khz() / 1000000;
+          vcpu.arm_timer(duration);
+          vcpu.start(guest_entry::tlb_shootdown, args);
+        } else {
+          args.r13 = vm.shared_gpa() + offsetof(tlb_shared, slots) + i * sizeof(tlb_shared::slot);
+          vcpu.start(guest_entry::tlb_receiver, args);
+        }
+
+        while (not (vcpu.resume() & (timeout_vcpu::timer_expired | timeout_vcpu::kicked)) and not done)
+          ;
+
+        if (i == 0) {
+          done = true;
+          for (unsigned r = 1; r < vcpus; r++)
+            pthread_kill(receivers[r], kick_signal);
+        }
+      });
+
+  for (auto &thread : threads)
+    thread.join();
+
+  tlb_result result;
+
+  result.shootdowns = shared->samples_head;
+  result.pv_flushes = shared->pv_flushes;
+  for (uint64_t i = 0; i < std::min<uint64_t>(result.shootdowns, tlb_shared::capacity); i++)
+    result.latency_ns.push_back(shared->samples[i] * 1e6 / tsc_khz);
+
+  return result;
+}
+
+/*
+ * Measure TLB shootdowns: how long it takes until a remapped page is flushed
+ * from all vCPUs, with IPIs only and with PV TLB flush, which skips the IPI
+ * for preempted vCPUs. Preemption only happens when the vCPU threads share
+ * host CPUs, so use --cpus to see the difference.
+ */
+static int tlb(options const &opts)
+{
+  unsigned vcpus = opts.get_u64("vcpus", 4);
+  unsigned cpus = opts.get_u64("cpus", 0);
+  std::chrono::nanoseconds duration = std::chrono::milliseconds { opts.get_u64("duration-ms", 1000) };
+  std::chrono::nanoseconds delay = std::chrono::microseconds { opts.get_u64("delay-us", 10) };
+
+  die_on(vcpus < 2 or vcpus >= guest_vm::max_vcpus, "invalid number of vCPUs");
+
+  uint32_t supported_pv = 0;
+  uint32_t const pv_flush_features = 1u << KVM_FEATURE_STEAL_TIME | 1u << KVM_FEATURE_PV_TLB_FLUSH;
+
+  for (auto const &leaf : kvm {}.get_supported_cpuid())
+    if (leaf.function == KVM_CPUID_FEATURES)
+      supported_pv = leaf.eax;
+
+  std::cout << vcpus << " vCPUs on " << (cpus ? std::to_string(cpus) : "all") << " CPUs, "
+            << delay.count() / 1000 << "us between shootdowns\n" << std::fixed << std::setprecision(0);
+
+  for (bool pv_flush : { false, true }) {
+    if (pv_flush and (supported_pv & pv_flush_features) != pv_flush_features) {
+      std::cout << "PV TLB flush: not supported by this host\n";
+      continue;
+    }
+
+    tlb_result r = run_tlb(pv_flush, vcpus, cpus, duration, delay);
+
+    std::cout << (pv_flush ? "PV TLB flush: " : "IPI:          ") << r.shootdowns * 1e9 / duration.count()
+              << " shootdowns/s";
+    if (not r.latency_ns.empty())
+      std::cout << ", latency p50 " << quantile(r.latency_ns, 0.5) << "ns, p90 " << quantile(r.latency_ns, 0.9)
+                << "ns, p99 " << quantile(r.latency_ns, 0.99) << "ns, max " << quantile(r.latency_ns, 1.0) << "ns";
+    if (pv_flush)
+      std::cout << ", " << r.pv_flushes << " flushes deferred to KVM";
+    std::cout << "\n";
+  }
+
+  return 0;
+}
+
+/* The pages page_fault_handler maps, at the start of shared memory. Layout must match guest.asm. */
+struct fault_shared {
+  uint64_t pages_base;
+  uint64_t pages;
+  uint64_t tables_base;   /* GPA of the PTE of the first page */
+};
+
+/* One way of running the page fault benchmark. */
+struct fault_variant {
+  char const *name;
+  bool guest_faults;      /* Unmap the pages in the guest after every pass */
+  bool discard;           /* Drop the host memory behind the pages before every pass */
+};
+
+static fault_variant const fault_variants[] {
+  { "no faults:                      ", false, false },
+  { "guest #PF, host memory present: ", true,  false },
+  { "host fault-in only:             ", false, true  },
+  { "guest #PF and host fault-in:    ", true,  true  },
+};
+
+/*
+ * Measure what a page fault costs the guest. Faults that the guest handles
+ * itself only take a #PF inside the VM, because EPT still maps the memory.
+ * When the host has discarded the memory behind a page, the first access also
+ * needs KVM to fault it in. Every pass writes to all pages once, and the
+ * results are per access.
+ */
+static int fault(options const &opts)
+{
+  uint64_t pages = opts.get_u64("pages", 4096);
+  uint64_t passes = opts.get_u64("passes", 50);
+
+  // The pages start at 64 MiB and are mapped by their own page tables, which follow them.
+  uint64_t const pages_base = 64 << 20;
+  uint64_t const pages_size = (pages * page_size + page_table::small_pages_end - 1) /
+                              page_table::small_pages_end * page_table::small_pages_end;
+  uint64_t const tables_base = pages_base + pages_size;
+  uint64_t const tables_size = pages_size / 512;
+
+  die_on(pages == 0 or passes == 0, "need at least one page and pass");
+  die_on(tables_base + tables_size > (1ULL << 30), "pages don't fit in the identity mapping");
+
+  std::cout << pages << " pages, " << passes << " passes\n" << std::fixed << std::setprecision(1);
+
+  for (auto const &variant : fault_variants) {
+    guest_vm vm { variant.guest_faults ? vm_page_faults : 0u };
+    guest_memory memory { &vm.get_kvm(), pages_base, pages_size };
+    guest_memory tables { &vm.get_kvm(), tables_base, tables_size };
+    timeout_vcpu vcpu { vm, 0 };
+    uint32_t tsc_khz = vcpu.tsc_khz();
+
+    vm.page_tables().map_small_pages();
+    for (uint64_t offset = 0; offset < pages_size; offset += page_table::small_pages_end)
+      vm.page_tables().map_page_table(pages_base + offset, tables_base + offset / 512);
+
+    // Without guest faults, the pages stay mapped all the time.
+    for (uint64_t i = 0; i < pages and not variant.guest_faults; i++)
+      tables.at<uint64_t>()[i] = vm.page_tables().pte(pages_base + i * page_size);
+
+    kvm_regs args {};
+
+    *vm.shared<fault_shared>() = { pages_base, pages, tables_base };
+    args.rsi = pages_base;
+    args.rdi = pages;
+    args.r8 = tables_base;
+    args.r9 = variant.guest_faults;
+    vcpu.start(guest_entry::page_fault_loop, args);
+
+    // The first pass faults everything in, so it doesn't count.
+    kvm_regs before {};
+
+    for (uint64_t pass = 0; pass <= passes; pass++) {
+      if (pass == 1)
+        before = vcpu.get_regs();
+      if (variant.discard)
+        memory.discard();
+
+      while (not (vcpu.resume() & timeout_vcpu::notified))
+        ;
+    }
+
+    kvm_regs after = vcpu.get_regs();
+    double accesses = std::max<uint64_t>(after.r15 - before.r15, 1);
+
+    std::cout << variant.name << (after.r13 - before.r13) * 1e6 / tsc_khz / accesses << "ns per access\n";
+  }
+
+  return 0;
+}
+
+/* One way of switching address spaces in the CR3 benchmark. */
+struct cr3_variant {
+  char const *name;
+  bool pcid;
+  uint64_t cr3_bits;      /* Added to the CR3 values */
+  uint64_t mode;          /* r10 of cr3_switch_loop */
+};
+
+static cr3_variant const cr3_variants[] {
+  { "no switch:            ", false, 0,           2 },
+  { "no PCID:              ", false, 0,           0 },
+  { "PCID, flush:          ", true,  0,           0 },
+  { "PCID, no flush:       ", true,  cr3_noflush, 0 },
+  { "PCID, INVPCID, switch:", true,  cr3_noflush, 1 },
+};
+
+/*
+ * Measure address space switches: several page tables map the same memory,
+ * and the guest switches between them round-robin and reads a few pages after
+ * every switch. Without PCID, every CR3 write flushes the TLB. With PCID, each
+ * address space keeps its own TLB entries unless the switch asks for a flush.
+ * The extra time for reading the pages compared to not switching at all is
+ * the TLB refill cost.
+ */
+static int cr3(options const &opts)
+{
+  unsigned spaces = opts.get_u64("spaces", 4);
+  uint64_t pages = opts.get_u64("pages", 64);
+  std::chrono::nanoseconds duration = std::chrono::milliseconds { opts.get_u64("duration-ms", 1000) };
+
+  // The pages start at 64 MiB and share one page table, which follows them.
+  uint64_t const pages_base = 64 << 20;
+  uint64_t const pages_size = page_table::small_pages_end;
+  uint64_t const pt_gpa = pages_base + pages_size;
+  uint64_t const spaces_base = pt_gpa + page_size;
+
+  die_on(spaces < 1 or spaces > 64, "invalid number of address spaces");
+  die_on(pages < 1 or pages > 512, "invalid number of pages");
+
+  bool have_pcid = false, have_invpcid = false;
+
+  for (auto const &leaf : kvm {}.get_supported_cpuid()) {
+    if (leaf.function == 1)
+      have_pcid = leaf.ecx & (1u << 17);
+    if (leaf.function == 7 and leaf.index == 0)
+      have_invpcid = leaf.ebx & (1u << 10);
+  }
+
+  host_fingerprint host;
+
+  for (auto const &v : host.values())
+    if (v.first == "kvm_intel.ept" or v.first == "kvm_amd.npt")
+      std::cout << v.first << "=" << v.second << "\n";
+
+  std::cout << spaces << " address spaces, " << pages << " pages read after each switch\n"
+            << std::fixed << std::setprecision(1);
+
+  double baseline_read_ns = 0;
+
+  for (auto const &variant : cr3_variants) {
+    if (variant.pcid and not have_pcid) {
+      std::cout << variant.name << " PCID not supported by this host\n";
+      continue;
+    }
+    if (variant.mode == 1 and not have_invpcid) {
+      std::cout << variant.name << " INVPCID not supported by this host\n";
+      continue;
+    }
+
+    guest_vm vm { variant.pcid ? vm_pcid : 0u };
+    guest_memory memory { &vm.get_kvm(), pages_base, pages_size };
+    guest_memory pt { &vm.get_kvm(), pt_gpa, page_size };
+    std::vector<std::unique_ptr<page_table>> tables;
+    auto cr3s = vm.shared<uint64_t>();
+
+    for (uint64_t i = 0; i < pages_size / page_size; i++)
+      pt.at<uint64_t>()[i] = vm.page_tables().pte(pages_base + i * page_size);
 
-    std::cout << "timeout " << timeout << "ms (took " << actual_ms <<  "ms) -> reps " << reps << std::endl;
+    for (unsigned i = 0; i < spaces; i++) {
+      tables.emplace_back(new page_table { &vm.get_kvm(), spaces_base + i * 4 * page_size });
+      tables.back()->map_small_pages();
+      tables.back()->map_page_table(pages_base, pt_gpa);
+
+      // PCID 0 belongs to the initial page table.
+      cr3s[i] = tables.back()->gpa() | (variant.pcid ? i + 1 : 0) | variant.cr3_bits;
+    }
+
+    timeout_vcpu vcpu { vm, 0 };
+    kvm_regs args {};
+
+    args.rsi = vm.shared_gpa();
+    args.rdi = spaces;
+    args.r8 = pages_base;
+    args.r9 = pages;
+    args.r10 = variant.mode;
+
+    vcpu.arm_timer(duration);
+    kvm_regs regs = vcpu.run(guest_entry::cr3_switch_loop, args);
+
+    double switches = std::max<uint64_t>(regs.r15, 1);
+    double khz = vcpu.tsc_khz();
+    double switch_ns = regs.r13 * 1e6 / khz / switches;
+    double read_ns = regs.r14 * 1e6 / khz / switches;
+
+    if (variant.mode == 2)
+      baseline_read_ns = read_ns;
+
+    std::cout << variant.name << " " << switch_ns << "ns per switch, " << read_ns << "ns reading the pages";
+    if (variant.mode != 2 and baseline_read_ns > 0)
+      std::cout << " (TLB refill " << read_ns - baseline_read_ns << "ns)";
+    std::cout << "\n";
+  }
+
+  return 0;
+}
+
+/*
+ * Run the split lock loop with split lock detection in the guest off and on.
+ * With detection on, every split lock raises #AC in the guest, which counts
+ * it and single-steps the locked instruction with detection off, like Linux
+ * does for user space. This shows whether the guest could enforce split lock
+ * policy itself instead of the host throttling the whole VM, and what that
+ * costs per locked instruction.
+ */
+static int sld(options const &opts)
+{
+  uint64_t slices = opts.get_u64("slices", 20);
+  std::chrono::nanoseconds slice = std::chrono::milliseconds { opts.get_u64("slice-ms", 10) };
+
+  die_on(slices == 0 or slice.count() == 0, "need at least one non-empty slice");
+
+  host_fingerprint host;
+
+  for (auto const &v : host.values())
+    if (v.first == "split_lock_detect" or v.first == "split_lock_mitigate")
+      std::cout << v.first << "=" << v.second << "\n";
+
+  timeout_vm vm { vm_split_lock_detect };
+
+  if (not vm.split_lock_detect_supported()) {
+    std::cout << "KVM doesn't offer split lock detection to guests on this host\n";
+    return EXIT_FAILURE;
+  }
+
+  std::cout << slices << " slices of " << slice.count() / 1000000 << "ms\n" << std::fixed << std::setprecision(1);
+
+  double ns_per_lock[2];
+
+  for (bool detect : { false, true }) {
+    uint64_t reps = 0, traps = 0;
+    std::chrono::nanoseconds wall {};
+
+    vm.set_split_lock_detect(detect);
+
+    for (uint64_t i = 0; i < slices; i++) {
+      auto before = std::chrono::steady_clock::now();
+
+      vm.arm_timer(slice);
+      kvm_regs regs = vm.run(guest_entry::slack_off, {});
+
+      wall += std::chrono::steady_clock::now() - before;
+      reps += regs.rax;
+      traps += regs.r14;
+    }
+
+    ns_per_lock[detect] = double(wall.count()) / std::max<uint64_t>(reps, 1);
+    std::cout << (detect ? "guest detection on:  " : "guest detection off: ") << reps * 1e6 / wall.count()
+              << " reps/ms, " << ns_per_lock[detect] << "ns per locked instruction, " << traps * 1e6 / wall.count()
+              << " #AC/ms\n";
+  }
+
+  std::cout << "guest-side detection costs " << ns_per_lock[1] - ns_per_lock[0] << "ns per split lock\n";
+
+  return 0;
+}
+
+/*
+ * Measure what an MSR access costs when userspace emulates the MSR compared
+ * to KVM handling it. Both run on IA32_MISC_ENABLE, which KVM always
+ * intercepts. In the userspace case, an MSR filter denies it to KVM and the
+ * access exits to userspace, where a handler emulates it.
+ */
+static int msr(options const &opts)
+{
+  uint64_t slices = opts.get_u64("slices", 20);
+  std::chrono::nanoseconds slice = std::chrono::milliseconds { opts.get_u64("slice-ms", 10) };
+  uint32_t const msr_misc_enable = 0x1a0;
+
+  die_on(slices == 0 or slice.count() == 0, "need at least one non-empty slice");
+
+  {
+    kvm probe;
+
+    if (not (probe.check_extension(KVM_CAP_X86_USER_SPACE_MSR) & KVM_MSR_EXIT_REASON_FILTER) or
+        not probe.check_extension(KVM_CAP_X86_MSR_FILTER)) {
+      std::cout << "KVM doesn't support userspace MSR exits on this host\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::cout << slices << " slices of " << slice.count() / 1000000 << "ms\n" << std::fixed << std::setprecision(1);
+
+  for (bool write : { false, true }) {
+    double ns_per_access[2];
+
+    for (bool user : { false, true }) {
+      timeout_vm vm { user ? vm_user_space_msr : 0u };
+      uint64_t emulated = 0;
+
+      if (user)
+        vm.emulate_msrs(msr_misc_enable, {
+            { [&emulated] (uint64_t &value) -> bool { value = emulated; return true; },
+              [&emulated] (uint64_t value) -> bool { emulated = value; return true; } } });
+
+      kvm_regs args {};
+      uint64_t accesses = 0, exits_before = vm.user_msr_exits();
+      std::chrono::nanoseconds wall {};
+
+      args.rsi = msr_misc_enable;
+      args.rdi = write;
+
+      for (uint64_t i = 0; i < slices; i++) {
+        auto before = std::chrono::steady_clock::now();
+
+        vm.arm_timer(slice);
+        accesses += vm.run(guest_entry::msr_loop, args).r15;
+        wall += std::chrono::steady_clock::now() - before;
+      }
+
+      ns_per_access[user] = double(wall.count()) / std::max<uint64_t>(accesses, 1);
+      std::cout << (write ? "wrmsr" : "rdmsr") << (user ? ", userspace: " : ", in-kernel: ") << ns_per_access[user]
+                << "ns per access";
+      if (user)
+        std::cout << ", " << vm.user_msr_exits() - exits_before << " exits to userspace";
+      std::cout << "\n";
+    }
+
+    std::cout << (write ? "wrmsr" : "rdmsr") << " in userspace costs " << ns_per_access[1] - ns_per_access[0]
+              << "ns more per access\n";
+  }
+
+  return 0;
+}
+
+static uint64_t steady_clock_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * Measure guest clocks against the host's steady_clock. First, the guest
+ * reads its TSC in a loop at each of the given TSC frequencies, and every
+ * slice compares how far the guest TSC advanced, converted with the
+ * frequency the guest was promised, with how much host time passed. Then
+ * the guest reads kvmclock, which starts out synchronized with steady_clock,
+ * and every slice compares the last value it read with steady_clock when the
+ * vCPU stopped. Both report the cost of one read.
+ */
+static int clocks(options const &opts)
+{
+  uint64_t slices = opts.get_u64("slices", 20);
+  std::chrono::nanoseconds slice = std::chrono::milliseconds { opts.get_u64("slice-ms", 10) };
+  std::vector<uint32_t> frequencies;
+
+  die_on(slices < 2 or slice.count() == 0, "need at least two non-empty slices");
+
+  uint32_t host_khz = timeout_vm {}.tsc_khz();
+
+  if (opts.has("khz")) {
+    std::istringstream list { opts.get("khz", "") };
+    std::string khz;
+
+    while (std::getline(list, khz, ',')) {
+      char *end = nullptr;
+      uint64_t value = strtoull(khz.c_str(), &end, 0);
+
+      die_on(khz.empty() or *end != '\0' or value == 0 or value > UINT32_MAX, "invalid value for --khz");
+      frequencies.push_back(value);
+    }
+  } else {
+    frequencies = { host_khz, host_khz / 2, host_khz * 2 };
+  }
+
+  if (not kvm {}.check_extension(KVM_CAP_TSC_CONTROL))
+    std::cout << "KVM can't change the guest TSC frequency on this host\n";
+
+  std::cout << slices << " slices of " << slice.count() / 1000000 << "ms, host TSC " << host_khz << "kHz\n"
+            << std::fixed << std::setprecision(1);
+
+  for (uint32_t khz : frequencies) {
+    timeout_vm vm;
+
+    if (khz != host_khz and not vm.set_tsc_khz(khz)) {
+      std::cout << "TSC " << khz << "kHz: not supported by this host\n";
+      continue;
+    }
+
+    std::vector<double> drift_ppm;
+    uint64_t reads = 0;
+    uint64_t last_tsc = 0, last_ns = 0;
+
+    vm.start(guest_entry::tsc_loop, {});
+
+    for (uint64_t i = 0; i <= slices; i++) {
+      vm.arm_timer(slice);
+      while (not (vm.resume() & timeout_vcpu::timer_expired))
+        ;
+
+      uint64_t now = steady_clock_ns();
+      kvm_regs regs = vm.get_regs();
+
+      // The first slice only gives us a starting point.
+      if (i > 0) {
+        double guest_ns = (regs.r14 - last_tsc) * 1e6 / khz;
+        double host_ns = now - last_ns;
+
+        drift_ppm.push_back((guest_ns - host_ns) / host_ns * 1e6);
+      }
+
+      reads = regs.r15;
+      last_tsc = regs.r14;
+      last_ns = now;
+    }
+
+    std::cout << "TSC " << khz << "kHz (guest sees " << vm.tsc_khz() << "kHz): "
+              << double(slice.count()) * (slices + 1) / std::max<uint64_t>(reads, 1) << "ns per read, drift p50 "
+              << quantile(drift_ppm, 0.5) << "ppm, min " << quantile(drift_ppm, 0.0) << "ppm, max "
+              << quantile(drift_ppm, 1.0) << "ppm\n";
+  }
+
+  {
+    timeout_vm vm { 0, 1u << KVM_FEATURE_CLOCKSOURCE2 };
+    std::vector<double> lag_us;
+    uint64_t reads = 0;
+
+    vm.enable_kvmclock(vm.shared_gpa());
+    vm.get_kvm().set_clock(steady_clock_ns());
+
+    kvm_regs args {};
+
+    args.rsi = vm.shared_gpa();
+    vm.start(guest_entry::kvmclock_loop, args);
+
+    for (uint64_t i = 0; i < slices; i++) {
+      vm.arm_timer(slice);
+      while (not (vm.resume() & timeout_vcpu::timer_expired))
+        ;
+
+      uint64_t now = steady_clock_ns();
+      kvm_regs regs = vm.get_regs();
+
+      // kvmclock must lag behind: the guest read it before the vCPU stopped.
+      lag_us.push_back((double(now) - double(regs.r14)) / 1e3);
+      reads = regs.r15;
+    }
+
+    std::cout << "kvmclock: " << double(slice.count()) * slices / std::max<uint64_t>(reads, 1)
+              << "ns per read, behind steady_clock by p50 " << quantile(lag_us, 0.5) << "us, min "
+              << quantile(lag_us, 0.0) << "us, max " << quantile(lag_us, 1.0) << "us, drift "
+              << (lag_us.back() - lag_us.front()) * 1e3 / (double(slice.count()) * (slices - 1) / 1e6) << "ppm\n";
+  }
+
+  return 0;
+}
+
+/*
+ * Run each workload alternately in the VM and natively on the host with the
+ * same time slices. The difference in throughput is the virtualization tax.
+ */
+static int native(options const &opts)
+{
+  std::vector<guest_entry> entries;
+  uint64_t max_timeout = opts.get_u64("max-timeout", 49);
+
+  if (opts.has("workload"))
+    entries.push_back(parse_guest_entry(opts.get("workload", "")));
+  else
+    entries = { guest_entry::slack_off, guest_entry::vector_loop };
+
+  timeout_vm vm;
+  native_runner host { guest_code, sizeof(guest_code), 2 << 20 };
+
+  for (guest_entry entry : entries) {
+    if (not workload(entry).native) {
+      fprintf(stderr, "workload '%s' can't run natively\n", workload(entry).name);
+      return EXIT_FAILURE;
+    }
+
+    uint64_t native_total = 0, kvm_total = 0;
+
+    std::cout << workload(entry).name << ":\n";
+
+    for (uint64_t timeout = 1; timeout <= max_timeout; timeout++) {
+      auto slice = std::chrono::milliseconds{timeout};
+
+      host.arm_timer(slice);
+      uint64_t native_reps = host.run(guest_entry_address(entry), workload_args(host, entry, opts)).*workload(entry).iterations;
+
+      vm.arm_timer(slice);
+      uint64_t kvm_reps = vm.run(entry, workload_args(vm, entry, opts)).*workload(entry).iterations;
+
+      native_total += native_reps;
+      kvm_total += kvm_reps;
+
+      std::cout << "timeout " << timeout << "ms -> native reps " << native_reps << ", kvm reps " << kvm_reps
+                << ", tax " << std::fixed << std::setprecision(1)
+                << 100.0 * (1.0 - double(kvm_reps) / std::max<uint64_t>(native_reps, 1)) << "%\n";
+    }
+
+    std::cout << workload(entry).name << " virtualization tax: " << std::fixed << std::setprecision(1)
+              << 100.0 * (1.0 - double(kvm_total) / std::max<uint64_t>(native_total, 1)) << "%\n";
   }
 
   return 0;
 }
+
+/* Print the host properties that make results comparable or noisy. */
+static int fingerprint(options const &)
+{
+  host_fingerprint host;
+
+  for (auto const &v : host.values())
+    std::cout << v.first << "=" << v.second << "\n";
+
+  for (auto const &w : host.warnings())
+    std::cout << "warning: " << w << "\n";
+
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  options opts { argc, argv };
+
+  if (opts.mode() == "fingerprint")
+    return fingerprint(opts);
+
+  if (not opts.has("no-host-warnings")) {
+    host_fingerprint host;
+
+    for (auto const &w : host.warnings())
+      fprintf(stderr, "warning: %s\n", w.c_str());
+  }
+
+  if (opts.mode() == "sweep")
+    return sweep(opts);
+  if (opts.mode() == "timeline")
+    return timeline(opts);
+  if (opts.mode() == "profile")
+    return profile(opts);
+  if (opts.mode() == "native")
+    return native(opts);
+  if (opts.mode() == "adaptive")
+    return adaptive(opts);
+  if (opts.mode() == "probe")
+    return probe(opts);
+  if (opts.mode() == "steal")
+    return steal(opts);
+  if (opts.mode() == "guest-steal")
+    return guest_steal(opts);
+  if (opts.mode() == "lhp")
+    return lhp(opts);
+  if (opts.mode() == "overcommit")
+    return overcommit(opts);
+  if (opts.mode() == "contexts")
+    return contexts(opts);
+  if (opts.mode() == "gang")
+    return gang(opts);
+  if (opts.mode() == "ipi")
+    return ipi(opts);
+  if (opts.mode() == "tlb")
+    return tlb(opts);
+  if (opts.mode() == "fault")
+    return fault(opts);
+  if (opts.mode() == "cr3")
+    return cr3(opts);
+  if (opts.mode() == "sld")
+    return sld(opts);
+  if (opts.mode() == "msr")
+    return msr(opts);
+  if (opts.mode() == "clock")
+    return clocks(opts);
+
+  fprintf(stderr, "unknown mode '%s'\n", opts.mode().c_str());
+  return EXIT_FAILURE;
+}